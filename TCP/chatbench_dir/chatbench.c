@@ -0,0 +1,476 @@
+/**
+ * @file chatbench.c
+ * @brief Load generator for the chat server: many simulated clients in one process.
+ *
+ * Usage: chatbench [-c CLIENTS] [-r RATE] [-d SECONDS] [-s SIZE] [-g ROOM_SIZE] hostname [PORT]
+ *   - -c number of client connections (default: 100).
+ *   - -r messages per second, all senders together (default: 100).
+ *   - -d sending time in seconds (default: 10).
+ *   - -s payload size in bytes (default: 64, at least enough for the timestamp).
+ *   - -g puts every ROOM_SIZE consecutive clients in their own room; 0 keeps
+ *     everyone in the lobby, so every message reaches every client (default: 0).
+ *   - If PORT is omitted, uses default 4242.
+ *
+ * Senders take turns; each message carries its send time (CLOCK_MONOTONIC),
+ * and every receiver records how long it took to arrive. At the end the tool
+ * prints the delivery throughput and the p50/p99/p99.9 latencies.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_PORT "4242"
+#define DEFAULT_CLIENTS 100
+#define DEFAULT_RATE 100
+#define DEFAULT_SECONDS 10
+#define DEFAULT_SIZE 64
+#define MIN_SIZE 24			 // '@' plus a 20-digit timestamp, and some slack
+#define WARMUP_MS 500		 // Lets the server register every client and join
+#define DRAIN_MS 2000		 // Waits this long for late deliveries after sending
+#define MAX_EVENTS 256
+#define RECV_SIZE 65536
+#define MAX_CATCHUP 1000	 // Sends per loop iteration when the loop fell behind
+#define HIST_SUB_BITS 4		 // 16 sub-buckets per power of two: <= 6% error
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+// Framing, must match chatserver.c
+#define FRAME_HEADER_SIZE 5
+#define FRAME_MAX 65536
+#define FRAME_CHAT 1
+#define FRAME_JOIN 3
+#define FRAME_PING 5 // Server heartbeat, answered so -i does not drop listeners
+#define FRAME_PONG 6
+
+/**
+ * @brief One simulated client.
+ */
+typedef struct s_bench_client
+{
+	int fd;
+	int room_size; // Clients in its room, itself included
+	char *in;	   // Bytes of a frame split across reads
+	size_t in_len;
+	size_t in_capacity;
+} t_bench_client;
+
+// Latency histogram, log-linear in nanoseconds
+static unsigned long histogram[HIST_BUCKETS];
+static unsigned long received = 0;
+static unsigned long long received_bytes = 0;
+static uint64_t max_latency = 0;
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/**
+ * @brief Histogram bucket of a latency: exact below 16 ns, then 16 buckets
+ * per power of two.
+ */
+int histIndex(uint64_t ns)
+{
+	if (ns < (1 << HIST_SUB_BITS))
+		return ((int)ns);
+	int msb = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+	return (((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub);
+}
+
+/**
+ * @brief Upper bound of the latencies falling into a bucket.
+ */
+uint64_t histValue(int index)
+{
+	if (index < (1 << HIST_SUB_BITS))
+		return (index);
+	int msb = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	uint64_t sub = index & ((1 << HIST_SUB_BITS) - 1);
+	return ((((1ULL << HIST_SUB_BITS) + sub + 1) << (msb - HIST_SUB_BITS)) - 1);
+}
+
+/**
+ * @brief Latency below which `fraction` of the deliveries arrived.
+ */
+uint64_t percentile(double fraction)
+{
+	unsigned long target = (unsigned long)(fraction * received);
+	unsigned long seen = 0;
+
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += histogram[i];
+		// The bucket's upper bound can overshoot the largest latency seen
+		if (seen > target)
+			return (histValue(i) < max_latency ? histValue(i) : max_latency);
+	}
+	return (max_latency);
+}
+
+/**
+ * @brief Read the payload length out of a frame header.
+ */
+uint32_t frameLength(const char *hdr)
+{
+	uint32_t netlen;
+
+	memcpy(&netlen, hdr, sizeof(netlen));
+	return (ntohl(netlen));
+}
+
+/**
+ * @brief Send a whole frame on a non-blocking socket.
+ *
+ * A frame is skipped when the socket is full before any of it went out;
+ * once part of it is sent, the rest waits for room so the stream stays
+ * framed.
+ * @return 0 on success, -1 if the socket is full or failed
+ */
+int sendFrame(int fd, uint8_t type, const char *data, uint32_t len)
+{
+	char frame[FRAME_HEADER_SIZE + FRAME_MAX];
+	uint32_t netlen = htonl(len);
+
+	memcpy(frame, &netlen, sizeof(netlen));
+	frame[4] = type;
+	memcpy(frame + FRAME_HEADER_SIZE, data, len);
+	size_t total = FRAME_HEADER_SIZE + len, done = 0;
+	while (done < total)
+	{
+		ssize_t sent = send(fd, frame + done, total - done, 0);
+		if (sent > 0)
+		{
+			done += sent;
+			continue;
+		}
+		if (sent == -1 && errno == EINTR)
+			continue;
+		if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && done > 0)
+		{
+			struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+			if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+				return (-1);
+			continue;
+		}
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * @brief Record the latency of a received chat frame.
+ *
+ * The relayed payload is "Client N: @<send time>xxx...", or "Client N@NODE:
+ * @<send time>xxx..." across a cluster, so the timestamp is looked for
+ * right after the prefix's ": ". Frames without a timestamp (server
+ * notices, operator messages) are ignored.
+ */
+void handleFrame(uint8_t type, const char *data, size_t len, uint64_t now)
+{
+	if (type != FRAME_CHAT)
+		return;
+	const char *colon = memchr(data, ':', len);
+	if (colon == NULL || (size_t)(colon - data) + 3 > len || colon[1] != ' ' || colon[2] != '@')
+		return;
+	const char *at = colon + 2;
+
+	char digits[21];
+	size_t n = len - (at + 1 - data);
+	if (n > sizeof(digits) - 1)
+		n = sizeof(digits) - 1;
+	memcpy(digits, at + 1, n);
+	digits[n] = '\0';
+	uint64_t sent = strtoull(digits, NULL, 10);
+	uint64_t latency = now > sent ? now - sent : 0;
+
+	histogram[histIndex(latency)]++;
+	if (latency > max_latency)
+		max_latency = latency;
+	received++;
+}
+
+/**
+ * @brief Read everything available on a client and handle complete frames.
+ * @return 0 on success, -1 if the connection is gone
+ */
+int readClient(t_bench_client *client)
+{
+	static char buffer[RECV_SIZE];
+
+	while (true)
+	{
+		ssize_t n = recv(client->fd, buffer, sizeof(buffer), 0);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return (0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		received_bytes += n;
+		uint64_t now = nowNs();
+
+		if (client->in_len + n > client->in_capacity)
+		{
+			size_t capacity = client->in_len + n;
+			char *grown = realloc(client->in, capacity);
+			if (grown == NULL)
+			{
+				perror("ChatBench: readClient: realloc()");
+				return (-1);
+			}
+			client->in = grown;
+			client->in_capacity = capacity;
+		}
+		memcpy(client->in + client->in_len, buffer, n);
+		client->in_len += n;
+
+		size_t pos = 0;
+		while (client->in_len - pos >= FRAME_HEADER_SIZE)
+		{
+			uint32_t len = frameLength(client->in + pos);
+			if (len > FRAME_MAX)
+				return (-1);
+			if (client->in_len - pos < FRAME_HEADER_SIZE + len)
+				break;
+			if (client->in[pos + 4] == FRAME_PING && sendFrame(client->fd, FRAME_PONG, "", 0) == -1)
+				return (-1);
+			handleFrame(client->in[pos + 4], client->in + pos + FRAME_HEADER_SIZE, len, now);
+			pos += FRAME_HEADER_SIZE + len;
+		}
+		memmove(client->in, client->in + pos, client->in_len - pos);
+		client->in_len -= pos;
+	}
+}
+
+/**
+ * @brief Connect one client (blocking), then make it non-blocking.
+ * @return the socket, or -1 on failure
+ */
+int connectClient(const struct addrinfo *ai)
+{
+	int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+	if (fd == -1)
+	{
+		perror("ChatBench: connectClient: socket()");
+		return (-1);
+	}
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+	{
+		perror("ChatBench: connectClient: connect()");
+		close(fd);
+		return (-1);
+	}
+	// Measure the server, not Nagle holding back the next small message
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		perror("ChatBench: connectClient: fcntl()");
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/**
+ * @brief Handle socket events until `deadline`, or until `expected`
+ * deliveries arrived (when non-zero).
+ *
+ * While `sending`, one message is sent every `interval` nanoseconds,
+ * senders taking turns; `sent` counts those that went out.
+ */
+void runUntil(int epollFd, t_bench_client *clients, int count, uint64_t deadline,
+			  bool sending, uint64_t interval, size_t size, unsigned long *sent,
+			  unsigned long long *expected)
+{
+	struct epoll_event events[MAX_EVENTS];
+	char payload[FRAME_MAX];
+	uint64_t next = nowNs();
+	unsigned long turn = 0;
+
+	while (true)
+	{
+		uint64_t now = nowNs();
+		if (now >= deadline)
+			return;
+		if (!sending && expected != NULL && received >= *expected)
+			return;
+
+		// Catch up on the sends that are due, bounded so reads still happen
+		for (int batch = 0; sending && next <= now && batch < MAX_CATCHUP; batch++)
+		{
+			t_bench_client *sender = &clients[turn++ % count];
+			int len = snprintf(payload, sizeof(payload), "@%llu", (unsigned long long)nowNs());
+			memset(payload + len, 'x', size - len);
+			if (sendFrame(sender->fd, FRAME_CHAT, payload, size) == 0)
+			{
+				*expected += sender->room_size - 1;
+				(*sent)++;
+			}
+			next += interval;
+		}
+
+		uint64_t until = sending ? next : deadline;
+		int timeout = until > now ? (int)((until - now) / 1000000) : 0;
+		int ready = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+		if (ready == -1 && errno != EINTR)
+		{
+			perror("ChatBench: runUntil: epoll_wait()");
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < ready; i++)
+		{
+			t_bench_client *client = events[i].data.ptr;
+			if (readClient(client) == -1)
+			{
+				fprintf(stderr, "ChatBench: fd %d disconnected\n", client->fd);
+				epoll_ctl(epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+			}
+		}
+	}
+}
+
+/**
+ * @brief Main entry point. Connects the clients, runs the load and reports.
+ */
+int main(int argc, char *const argv[])
+{
+	int count = DEFAULT_CLIENTS, rate = DEFAULT_RATE, seconds = DEFAULT_SECONDS;
+	int size = DEFAULT_SIZE, roomSize = 0, opt;
+	const char *hostname, *port = DEFAULT_PORT;
+
+	// Parse arguments: [-c CLIENTS] [-r RATE] [-d SECONDS] [-s SIZE] [-g ROOM_SIZE] hostname [PORT]
+	while ((opt = getopt(argc, argv, "c:r:d:s:g:")) != -1)
+	{
+		if (opt == 'c' && (count = atoi(optarg)) >= 2)
+			continue;
+		if (opt == 'r' && (rate = atoi(optarg)) >= 1)
+			continue;
+		if (opt == 'd' && (seconds = atoi(optarg)) >= 1)
+			continue;
+		if (opt == 's' && (size = atoi(optarg)) >= MIN_SIZE && size <= FRAME_MAX)
+			continue;
+		if (opt == 'g' && (roomSize = atoi(optarg)) >= 0)
+			continue;
+		fprintf(stderr, "Usage: chatbench [-c CLIENTS] [-r RATE] [-d SECONDS] [-s SIZE] [-g ROOM_SIZE] hostname [PORT]\n");
+		return (EXIT_FAILURE);
+	}
+	if (argc - optind < 1 || argc - optind > 2)
+	{
+		fprintf(stderr, "Usage: chatbench [-c CLIENTS] [-r RATE] [-d SECONDS] [-s SIZE] [-g ROOM_SIZE] hostname [PORT]\n");
+		return (EXIT_FAILURE);
+	}
+	hostname = argv[optind];
+	if (argc - optind == 2)
+		port = argv[optind + 1];
+	if (roomSize == 0 || roomSize > count)
+		roomSize = count;
+
+	setbuf(stdout, NULL); // Disable buffering for stdout
+	setbuf(stderr, NULL); // Disable buffering for stderr
+	signal(SIGPIPE, SIG_IGN);
+
+	// Thousands of connections need more than the usual 1024 fds
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	// Resolve server address once for every client
+	struct addrinfo hints = {0}, *serverAddr;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int rv;
+	if ((rv = getaddrinfo(hostname, port, &hints, &serverAddr)) != 0)
+	{
+		fprintf(stderr, "ChatBench: getaddrinfo(): %s\n", gai_strerror(rv));
+		return (EXIT_FAILURE);
+	}
+
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	t_bench_client *clients = calloc(count, sizeof(t_bench_client));
+	if (epollFd == -1 || clients == NULL)
+	{
+		perror("ChatBench: main: setup");
+		return (EXIT_FAILURE);
+	}
+
+	printf("ChatBench: connecting %d clients to %s:%s\n", count, hostname, port);
+	for (int i = 0; i < count; i++)
+	{
+		t_bench_client *client = &clients[i];
+		if ((client->fd = connectClient(serverAddr)) == -1)
+		{
+			fprintf(stderr, "ChatBench: only %d clients connected\n", i);
+			return (EXIT_FAILURE);
+		}
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = client};
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, client->fd, &ev) == -1)
+		{
+			perror("ChatBench: main: epoll_ctl()");
+			return (EXIT_FAILURE);
+		}
+
+		// The last room may be smaller than the others
+		int first = i / roomSize * roomSize;
+		client->room_size = (first + roomSize <= count) ? roomSize : count - first;
+		if (roomSize < count)
+		{
+			char room[32];
+			int len = snprintf(room, sizeof(room), "bench%d", i / roomSize);
+			if (sendFrame(client->fd, FRAME_JOIN, room, len) == -1)
+			{
+				perror("ChatBench: main: send()");
+				return (EXIT_FAILURE);
+			}
+		}
+	}
+	freeaddrinfo(serverAddr);
+
+	unsigned long sent = 0;
+	unsigned long long expected = 0;
+	runUntil(epollFd, clients, count, nowNs() + WARMUP_MS * 1000000ULL, false, 0, size, &sent, NULL);
+	received = 0;
+	received_bytes = 0;
+
+	printf("ChatBench: sending %d msg/s of %d bytes for %d s, rooms of %d\n", rate, size, seconds, roomSize);
+	uint64_t start = nowNs();
+	runUntil(epollFd, clients, count, start + seconds * 1000000000ULL, true,
+			 1000000000ULL / rate, size, &sent, &expected);
+	runUntil(epollFd, clients, count, nowNs() + DRAIN_MS * 1000000ULL, false, 0, size, &sent, &expected);
+	double elapsed = (nowNs() - start) / 1e9;
+
+	printf("ChatBench: sent %lu messages, %lu deliveries expected\n", sent, (unsigned long)expected);
+	printf("ChatBench: received %lu deliveries (%.2f%%) in %.2f s: %.0f msg/s, %.2f MB/s\n",
+		   received, expected ? 100.0 * received / expected : 0.0, elapsed,
+		   received / elapsed, received_bytes / elapsed / 1e6);
+	if (received > 0)
+		printf("ChatBench: latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+			   percentile(0.50) / 1e3, percentile(0.99) / 1e3, percentile(0.999) / 1e3,
+			   max_latency / 1e3);
+	return (EXIT_SUCCESS);
+}
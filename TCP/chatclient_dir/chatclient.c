@@ -4,13 +4,23 @@
  *
  * Usage: chatclient hostname [PORT]
  *   - If PORT is omitted, uses default 4242.
+ *
+ * Messages are exchanged as frames: a 4-byte payload length (network byte
+ * order), a 1-byte frame type and the payload.
+ *
+ * "/join ROOM" moves to another room, "/leave" goes back to the lobby; chat
+ * text only reaches the members of the current room.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <poll.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -20,12 +30,28 @@
 
 #define DEFAULT_PORT "4242"
 #define BUFFER_SIZE 256
+#define CONNECT_STAGGER_MS 250 // Head start of an address over the next one
+#define MAX_CANDIDATES 16
+
+// Framing, must match chatserver.c
+#define FRAME_HEADER_SIZE 5
+#define FRAME_MAX 65536
+#define FRAME_CHAT 1
+#define FRAME_CLEAR 2
+#define FRAME_JOIN 3  // Payload is the room name, empty for the lobby
+#define FRAME_LEAVE 4 // Back to the lobby
+#define FRAME_PING 5  // Server heartbeat, answered with FRAME_PONG
+#define FRAME_PONG 6
 
 // Global variables for input line management
 static char current_input[BUFFER_SIZE] = {0};
 static int input_pos = 0;
 static struct termios orig_termios;
 
+// Bytes received from the server that do not form a complete frame yet
+static char recv_buffer[FRAME_HEADER_SIZE + FRAME_MAX];
+static size_t recv_len = 0;
+
 /**
  * @brief Extracts pointer to IPv4 or IPv6 address from sockaddr.
  */
@@ -36,6 +62,139 @@ void *getinaddr(struct sockaddr *sa)
 	return (&(((struct sockaddr_in6 *)sa)->sin6_addr));
 }
 
+/**
+ * @brief Current CLOCK_MONOTONIC time in milliseconds.
+ */
+int64_t monotonicMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * @brief Order resolved addresses for connectRace().
+ *
+ * Families alternate, starting with the family getaddrinfo() preferred,
+ * so that a broken family costs one stagger step instead of every address.
+ *
+ * @return the number of addresses stored in `order`
+ */
+int orderAddresses(const struct addrinfo *list, const struct addrinfo *order[MAX_CANDIDATES])
+{
+	const struct addrinfo *preferred[MAX_CANDIDATES], *other[MAX_CANDIDATES];
+	int preferredCount = 0, otherCount = 0, count = 0;
+
+	for (const struct addrinfo *p = list; p != NULL; p = p->ai_next)
+	{
+		if (p->ai_family == list->ai_family && preferredCount < MAX_CANDIDATES)
+			preferred[preferredCount++] = p;
+		else if (p->ai_family != list->ai_family && otherCount < MAX_CANDIDATES)
+			other[otherCount++] = p;
+	}
+	for (int i = 0; count < MAX_CANDIDATES && (i < preferredCount || i < otherCount); i++)
+	{
+		if (i < preferredCount)
+			order[count++] = preferred[i];
+		if (i < otherCount && count < MAX_CANDIDATES)
+			order[count++] = other[i];
+	}
+	return (count);
+}
+
+/**
+ * @brief Connect to `order` with staggered, racing attempts.
+ *
+ * The next address gets a non-blocking connect every CONNECT_STAGGER_MS
+ * while the earlier ones are still pending, or as soon as one fails; the
+ * first to complete wins and the others are closed. The returned socket is
+ * blocking again.
+ *
+ * @return the socket, with `*used` set to its address, or -1 with errno
+ * set when every address failed
+ */
+int connectRace(const struct addrinfo *const *order, int count, const struct addrinfo **used)
+{
+	struct pollfd pfds[MAX_CANDIDATES];
+	int owner[MAX_CANDIDATES]; // Candidate index of each pending socket
+	int pending = 0, next = 0, winner = -1, fd = -1, lastError = ECONNREFUSED;
+	int64_t nextStart = monotonicMs();
+
+	while (winner == -1 && (pending > 0 || next < count))
+	{
+		// Start the next address when its turn came or nothing is in flight
+		int64_t now = monotonicMs();
+		if (next < count && (pending == 0 || now >= nextStart))
+		{
+			const struct addrinfo *ai = order[next];
+			int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (s == -1 || fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK) == -1)
+				lastError = errno;
+			else if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+			{
+				winner = next;
+				fd = s;
+			}
+			else if (errno == EINPROGRESS)
+			{
+				pfds[pending] = (struct pollfd){.fd = s, .events = POLLOUT};
+				owner[pending++] = next;
+				nextStart = now + CONNECT_STAGGER_MS;
+				s = -1;
+			}
+			else
+				lastError = errno;
+			if (s != -1 && winner == -1)
+				close(s);
+			next++;
+			continue;
+		}
+
+		int timeout = next < count ? (int)(nextStart - now) : -1;
+		int ready = poll(pfds, pending, timeout);
+		if (ready == -1 && errno != EINTR)
+		{
+			lastError = errno;
+			break;
+		}
+		for (int i = 0; ready > 0 && i < pending; i++)
+		{
+			if (pfds[i].revents == 0)
+				continue;
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+				err = errno;
+			if (err == 0)
+			{
+				winner = owner[i];
+				fd = pfds[i].fd;
+				pfds[i] = pfds[--pending];
+				break;
+			}
+			// A failed attempt hands over to the next address right away
+			lastError = err;
+			close(pfds[i].fd);
+			pfds[i] = pfds[--pending];
+			owner[i] = owner[pending];
+			nextStart = monotonicMs();
+			i--;
+		}
+	}
+	for (int i = 0; i < pending; i++)
+		close(pfds[i].fd);
+
+	if (winner == -1)
+	{
+		errno = lastError;
+		return (-1);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+	*used = order[winner];
+	return (fd);
+}
+
 /**
  * @brief Portable IP string extraction from sockaddr (IPv4/IPv6)
  * @param sa Pointer to sockaddr
@@ -101,13 +260,64 @@ void signal_handler(int sig)
 	exit(EXIT_SUCCESS);
 }
 
+/**
+ * @brief Read the payload length out of a frame header.
+ */
+uint32_t frameLength(const char *hdr)
+{
+	uint32_t netlen;
+
+	memcpy(&netlen, hdr, sizeof(netlen));
+	return (ntohl(netlen));
+}
+
+/**
+ * @brief Send one chat frame to the server, retrying partial sends.
+ * @return 0 on success, -1 on failure
+ */
+int sendFrame(int sockFd, uint8_t type, const char *data, uint32_t len)
+{
+	char frame[FRAME_HEADER_SIZE + BUFFER_SIZE];
+	uint32_t netlen = htonl(len);
+	size_t total = FRAME_HEADER_SIZE + len, sent = 0;
+
+	memcpy(frame, &netlen, sizeof(netlen));
+	frame[4] = type;
+	memcpy(frame + FRAME_HEADER_SIZE, data, len);
+	while (sent < total)
+	{
+		ssize_t rc = send(sockFd, frame + sent, total - sent, MSG_NOSIGNAL);
+		if (rc == -1)
+			return (-1);
+		sent += rc;
+	}
+	return (0);
+}
+
+/**
+ * @brief Display one complete frame received from the server.
+ */
+void handleFrame(uint8_t type, const char *data, uint32_t len)
+{
+	if (type == FRAME_CLEAR)
+		printf("\033c");
+	else if (type == FRAME_CHAT)
+		printf("\r\033[2K%.*s\n", (int)len, data);
+	else
+		return;
+	// Restore the input line under the message
+	redraw_input_line();
+}
+
 /**
  * @brief Handle incoming messages from server
+ *
+ * Data is appended to recv_buffer; every complete frame in it is displayed
+ * and a trailing partial frame is kept for the next read.
  */
 void handleServerMessage(int sockFd)
 {
-	char buffer[BUFFER_SIZE];
-	ssize_t bytesRead = recv(sockFd, buffer, sizeof(buffer), 0);
+	ssize_t bytesRead = recv(sockFd, recv_buffer + recv_len, sizeof(recv_buffer) - recv_len, 0);
 
 	if (bytesRead == 0)
 	{
@@ -121,10 +331,30 @@ void handleServerMessage(int sockFd)
 		disable_raw_mode();
 		exit(EXIT_FAILURE);
 	}
+	recv_len += bytesRead;
 
-	// Clear current input line, print message, then restore input
-	printf("\r\033[2K%.*s", (int)bytesRead, buffer);
-	redraw_input_line();
+	size_t pos = 0;
+	while (recv_len - pos >= FRAME_HEADER_SIZE)
+	{
+		uint32_t len = frameLength(recv_buffer + pos);
+		if (len > FRAME_MAX)
+		{
+			printf("\nChatClient: invalid frame from server\n");
+			disable_raw_mode();
+			exit(EXIT_FAILURE);
+		}
+		if (recv_len - pos < FRAME_HEADER_SIZE + len)
+			break;
+		if (recv_buffer[pos + 4] == FRAME_PING)
+			sendFrame(sockFd, FRAME_PONG, "", 0);
+		else
+			handleFrame(recv_buffer[pos + 4], recv_buffer + pos + FRAME_HEADER_SIZE, len);
+		pos += FRAME_HEADER_SIZE + len;
+	}
+
+	// Keep the partial frame at the start of the buffer
+	memmove(recv_buffer, recv_buffer + pos, recv_len - pos);
+	recv_len -= pos;
 }
 
 /**
@@ -155,8 +385,15 @@ void handleUserInput(int sockFd)
 		// Send the message
 		if (input_pos > 0)
 		{
-			current_input[input_pos] = '\n';
-			if (send(sockFd, current_input, input_pos + 1, MSG_NOSIGNAL) == -1)
+			int sent;
+			current_input[input_pos] = '\0';
+			if (strncmp(current_input, "/join ", 6) == 0)
+				sent = sendFrame(sockFd, FRAME_JOIN, current_input + 6, input_pos - 6);
+			else if (strcmp(current_input, "/leave") == 0)
+				sent = sendFrame(sockFd, FRAME_LEAVE, "", 0);
+			else
+				sent = sendFrame(sockFd, FRAME_CHAT, current_input, input_pos);
+			if (sent == -1)
 			{
 				perror("ChatClient: handleUserInput: send()");
 				disable_raw_mode();
@@ -234,7 +471,7 @@ void polling(int sockFd)
  */
 int main(int argc, char const *argv[])
 {
-	struct addrinfo hints, *serverAddr;
+	struct addrinfo hints = {0}, *theirAddr;
 	const char *hostname, *port;
 
 	// Parse arguments: hostname required, PORT optional
@@ -252,48 +489,25 @@ int main(int argc, char const *argv[])
 	setbuf(stdout, NULL); // Disable buffering for stdout
 	setbuf(stderr, NULL); // Disable buffering for stderr
 
-	// Setup TCP socket hints
-	hints = (struct addrinfo){0};
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-
 	// Resolve server address
 	int rv;
-	if ((rv = getaddrinfo(hostname, port, &hints, &serverAddr)) != 0)
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rv = getaddrinfo(hostname, port, &hints, &theirAddr)) != 0)
 	{
 		fprintf(stderr, "ChatClient: getaddrinfo(): %s\n", gai_strerror(rv));
 		return (EXIT_FAILURE);
 	}
 
-	// Create and connect TCP socket
-	struct addrinfo *p;
+	// Connect to the address that answers first
+	const struct addrinfo *order[MAX_CANDIDATES], *p;
 	char serverIP[INET6_ADDRSTRLEN];
-	int sockFd;
-	for (p = serverAddr; p != NULL; p = p->ai_next)
-	{
-		// Create socket
-		if ((sockFd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
-		{
-			perror("ChatClient: main: socket()");
-			continue;
-		}
-
-		// Connect to server
-		if (connect(sockFd, p->ai_addr, p->ai_addrlen) == -1)
-		{
-			perror("ChatClient: main: connect()");
-			close(sockFd);
-			continue;
-		}
-
-		break;
-	}
-
-	// Check if we successfully connected
-	if (p == NULL)
+	int sockFd = connectRace(order, orderAddresses(theirAddr, order), &p);
+	if (sockFd == -1)
 	{
+		perror("ChatClient: main: connect()");
 		fprintf(stderr, "ChatClient: failed to connect to %s:%s\n", hostname, port);
-		freeaddrinfo(serverAddr);
+		freeaddrinfo(theirAddr);
 		return (EXIT_FAILURE);
 	}
 
@@ -302,6 +516,7 @@ int main(int argc, char const *argv[])
 		strcpy(serverIP, "?");
 	printf("ChatClient: connected to %s:%s\n", serverIP, port);
 	printf("ChatClient: type your messages and press Enter to send\n");
+	printf("ChatClient: '/join ROOM' to change room, '/leave' for the lobby\n");
 	printf("ChatClient: press Ctrl+C or Ctrl+D to quit\n");
 	printf("----------------------------------------\n");
 
@@ -316,7 +531,7 @@ int main(int argc, char const *argv[])
 	printf("You: ");
 	fflush(stdout);
 
-	freeaddrinfo(serverAddr);
+	freeaddrinfo(theirAddr);
 
 	polling(sockFd);
 
@@ -1,27 +1,616 @@
+/**
+ * @file chatserver.c
+ * @brief TCP chat server: relays client messages to the other members of their room.
+ *
+ * Wire protocol (both directions): every message is a frame made of a 4-byte
+ * payload length (network byte order), a 1-byte frame type and the payload.
+ * Clients start in the lobby (the room with an empty name) and move with
+ * FRAME_JOIN / FRAME_LEAVE; server messages reach every room.
+ *
+ * Usage: chatserver [-d] [-a inet|inet6|dual] [-l BACKLOG] [-c CONNS_PER_IP]
+ *                   [-b poll|epoll|uring] [-t THREADS] [-m ADMIN_PORT]
+ *                   [-q BYTES] [-Q BYTES] [-P drop-oldest|disconnect|skip]
+ *                   [-w USEC] [-i SECONDS] [-k SECONDS] [-D SECONDS]
+ *                   [-H DIR [-n REPLAY]]
+ *                   [-N NODE_ID [-L RELAY_PORT] [-R HOST:PORT]...] [PORT]
+ *   - -d runs headless: stdin is ignored, chat text is not echoed and the
+ *     remaining log lines are buffered and written by a background thread.
+ *     Implied when stdin is not a terminal.
+ *   - -a picks the listener address family (default: inet); dual accepts
+ *     IPv4 and IPv6 clients on one IPv6 socket.
+ *   - -l sets the listen() backlog (default: SOMAXCONN, 4096); -c caps the
+ *     connections from one source address (default: unlimited).
+ *   - -b selects the event backend (default: epoll; uring falls back to
+ *     epoll, epoll to poll, when the kernel lacks support).
+ *   - -t runs THREADS event loops, each with its own SO_REUSEPORT listener
+ *     and client set (default: 1).
+ *   - -m serves Prometheus-style metrics on ADMIN_PORT (default: off).
+ *   - -q / -Q cap the bytes queued for one client (default: 1 MiB) and for
+ *     all clients (default: 256 MiB, split evenly between threads); -P picks
+ *     what happens to a client over a cap: drop-oldest (default) drops its
+ *     oldest queued messages, disconnect closes it, skip stops queueing
+ *     anything but server messages for it.
+ *   - -H appends every relayed message to a memory-mapped log in DIR and
+ *     replays the last REPLAY (-n, default: 20) messages of a room to
+ *     clients joining it (default: no history). Only the newest
+ *     HISTORY_SEGMENTS log files are kept.
+ *   - -w lets queued messages wait up to USEC microseconds, so that more of
+ *     them go out in each client's single write (default: 0, every loop
+ *     iteration flushes what it queued).
+ *   - -i disconnects clients that send nothing for SECONDS (default: off);
+ *     -k sends a FRAME_PING, answered with a FRAME_PONG, to clients that
+ *     sent nothing for SECONDS (default: off), so that with -k shorter than
+ *     -i only dead or stuck clients time out; -D disconnects
+ *     clients whose socket takes nothing for SECONDS while messages are
+ *     waiting for them (default: 30, 0 turns it off).
+ *   - -N makes this server node NODE_ID (1-64) of a cluster: chat text is
+ *     relayed to the other nodes over relay links, accepted on RELAY_PORT
+ *     (-L) and dialled to every -R peer (up to 16, redialled when down).
+ *   - If PORT is omitted, uses default 4242.
+ */
+
+#define _GNU_SOURCE // ppoll()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <unistd.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <time.h>
 #include <iso646.h>
 #include <termios.h>
 
 #define DEFAULT_PORT "4242"
 #define DEFAULT_MSG "Hello from ChatServer!"
-#define BACKLOG 10
+#define USAGE                                                                      \
+	"Usage: chatserver [-d] [-a inet|inet6|dual] [-l BACKLOG] [-c CONNS_PER_IP]\n"   \
+	"                  [-b poll|epoll|uring] [-t THREADS] [-m ADMIN_PORT]\n"         \
+	"                  [-q BYTES] [-Q BYTES] [-P drop-oldest|disconnect|skip]\n"     \
+	"                  [-w USEC] [-i SECONDS] [-k SECONDS] [-D SECONDS]\n"           \
+	"                  [-H DIR [-n REPLAY]]\n"                                     \
+	"                  [-N NODE_ID [-L RELAY_PORT] [-R HOST:PORT]...] [PORT]\n"
+#define BACKLOG SOMAXCONN // Default -l, capped by net.core.somaxconn
 #define BUFFER_SIZE 256
+#define RECV_SIZE 16384
+#define MAX_EVENTS 64
+#define MAX_THREADS 256
+#define HEADER_SIZE 32
+
+// Framing, must match chatclient.c
+#define FRAME_HEADER_SIZE 5
+#define FRAME_MAX 65536
+#define FRAME_CHAT 1  // Chat text, "Client N: " prefixed when relayed
+#define FRAME_CLEAR 2 // Server asks clients to clear their screen
+#define FRAME_JOIN 3  // Client moves to the room named by the payload
+#define FRAME_LEAVE 4 // Client goes back to the lobby
+#define FRAME_PING 5  // Server heartbeat, empty payload
+#define FRAME_PONG 6  // Client answer to FRAME_PING
+#define FRAME_RELAY 7 // Relay links only: a chat message from another node
+#define FRAME_HELLO 8 // Relay links only: first frame, the sender's node id
+#define ROOM_NAME_MAX 32
+#define ROOM_BUCKETS 64 // Initial size of a shard's room index, grows x2
+#define OUTQ_MIN 16
+#define OUTQ_MAX 4096
+#define FLUSH_BATCH 32
+#define URING_ENTRIES 4096
+#define URING_CQ_ENTRIES 16384
+#define URING_BUFS 256 // Provided receive buffers per shard, RECV_SIZE each
+#define URING_BGID 0
+#define SLAB_SESSIONS 256	  // Sessions carved out of one pool allocation
+#define MAX_SESSIONS 1048576 // Upper bound for the fd-indexed session table
+#define LATENCY_BUCKETS 16
+#define ADMIN_TIMEOUT_MS 1000 // Admin socket I/O timeout and rate sampling period
+#define LOG_BUFFER_SIZE 65536 // Headless log lines waiting for the log thread
+#define LOG_FLUSH_MS 100
+#define SEGMENT_SIZE (16 * 1024 * 1024) // History log segment file size
+#define HISTORY_RING 4096				// Most recent messages kept indexed
+#define HISTORY_REPLAY 20				// Default -n
+#define HISTORY_SYNC_MS 1000			// Background fdatasync period
+#define HISTORY_SEGMENTS 16				// Segment files kept on disk, older ones are deleted
+#define CLIENT_OUTQ_BYTES (1024 * 1024)		  // Default -q
+#define GLOBAL_OUTQ_BYTES (256UL * 1024 * 1024) // Default -Q
+#define DIRTY_MIN 64 // Initial size of a shard's list of clients to flush
+#define PEER_BUCKETS 1024 // Initial size of the per-address connection table, grows x2
+#define TIMER_TICK_MS 10
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4	  // 64^4 ticks of 10 ms, timers up to 194 days ahead
+#define FLUSH_DEADLINE 30 // Default -D, seconds
+#define MAX_NODES 64	  // Node ids are 1..64, one bit each in a relayed message
+#define MAX_RELAYS 16	  // -R peers
+#define MAX_LINKS 64	  // Relay links, dialled and accepted
+#define RELAY_RETRY_MS 1000
+#define RELAY_OUTQ_BYTES (64 * 1024 * 1024) // Bytes queued on a link before it is dropped
+#define RELAY_HEADER_SIZE 30 // origin, incarnation, seq, visited, room and prefix lengths
+#define RELAY_WINDOW 64		 // Sequence numbers remembered per origin, one bit each
+#define RELAY_FRAME_MAX (RELAY_HEADER_SIZE + ROOM_NAME_MAX + HEADER_SIZE + FRAME_MAX)
+
+/**
+ * @brief Event notification mechanism used by the main loop.
+ *
+ * BACKEND_POLL rescans the whole pollfd array on every wakeup, BACKEND_EPOLL
+ * only returns ready fds (edge-triggered for sockets). BACKEND_URING is
+ * completion based: accepts and receives are multishot requests, sends are
+ * queued as SQEs and submitted together with the next wait.
+ */
+typedef enum e_backend
+{
+	BACKEND_POLL,
+	BACKEND_EPOLL,
+	BACKEND_URING
+} t_backend;
+
+/**
+ * @brief What to do with a client whose queued bytes would exceed a limit.
+ */
+typedef enum e_slow_policy
+{
+	SLOW_DROP_OLDEST, // Drop its oldest queued messages to make room
+	SLOW_DISCONNECT,  // Disconnect it
+	SLOW_SKIP		  // Only queue critical (server) messages for it
+} t_slow_policy;
+
+/**
+ * @brief Kind of request an io_uring completion belongs to.
+ *
+ * Stored in the low bits of the SQE user_data, next to the t_client pointer.
+ */
+typedef enum e_uring_op
+{
+	UOP_NONE,	// Cancel requests, their completion is ignored
+	UOP_ACCEPT, // Multishot accept on the listener
+	UOP_POLL,	// Multishot poll on the wakeup eventfd or stdin
+	UOP_RECV,	// Multishot recv into the provided buffer ring
+	UOP_SEND	// sendmsg of a client's queued messages
+} t_uring_op;
+
+#define UOP_MASK 7ULL
+
+/**
+ * @brief A raw io_uring instance (no liburing) and its provided buffers.
+ */
+typedef struct s_uring
+{
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;	// Local tail, published on submit
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned short br_tail;
+} t_uring;
+
+/**
+ * @brief What a watched fd is, so the event loop knows how to handle it.
+ */
+typedef enum e_conn_kind
+{
+	CONN_LISTENER,
+	CONN_WAKEUP,
+	CONN_STDIN,
+	CONN_CLIENT
+} t_conn_kind;
+
+/**
+ * @brief A relayed message, built once and shared by every recipient.
+ *
+ * The header (frame header plus "Client %d: " prefix) and the payload are
+ * kept apart so they can be sent as two iovecs. Each queue (client ring, shard inbox) holding the
+ * message owns one reference; the last release frees it. Messages replayed
+ * from the history have no header: `ext` points at the whole frame inside
+ * a mapped log segment, which they keep mapped.
+ */
+typedef struct s_message
+{
+	atomic_int refs;
+	const char *ext;			// If set, the payload lives here instead of in data
+	struct s_segment *segment; // History segment `ext` points into
+	uint64_t born_ns; // CLOCK_MONOTONIC creation time, for fan-out latency
+	size_t header_len;
+	size_t len;
+	bool critical;					// Server message, never skipped for slow clients
+	bool to_room;					// false: every client, true: members of `room`
+	char room[ROOM_NAME_MAX + 1];	// Looked up again by each shard
+	char header[HEADER_SIZE];
+	char data[];
+} t_message;
+
+/**
+ * @brief A chat room and the clients of one shard subscribed to it.
+ *
+ * Every shard indexes its own rooms by name, so a room whose members are
+ * spread over several shards has one entry (and member list) in each. A
+ * room is created on first join and freed when its last member leaves.
+ */
+typedef struct s_room
+{
+	char name[ROOM_NAME_MAX + 1];
+	struct s_client **members;
+	int members_count;
+	int members_capacity;
+	struct s_room *next; // Next room in the same hash bucket
+} t_room;
+
+/**
+ * @brief Number of connections from one source address, for -c.
+ *
+ * IPv4 addresses are stored IPv4-mapped, so one table serves both families.
+ */
+typedef struct s_peer
+{
+	struct in6_addr addr;
+	int conns;
+	struct s_peer *next; // Next entry in the same hash bucket
+} t_peer;
+
+/**
+ * @brief A peer node given with -R, dialled (and redialled) by the relay thread.
+ */
+typedef struct s_relay
+{
+	const char *host;
+	const char *port;
+	unsigned node;	   // Its node id once a link said hello, 0 before
+	int link;		   // Index in links while connected, -1 otherwise
+	uint64_t retry_ns; // Next dial attempt
+} t_relay;
+
+/**
+ * @brief A relay link: a TCP connection to another node of the cluster.
+ *
+ * Carries the same framing as client connections. Outbound messages wait in
+ * `queue` until the socket takes them, like a client's.
+ */
+typedef struct s_link
+{
+	int fd;				// -1 while the slot is free
+	int relay;			// Index in relays for dialled links, -1 for accepted ones
+	unsigned node;		// Peer node id, 0 until its FRAME_HELLO arrived
+	bool connecting;	// Non-blocking connect() in progress
+	char *in;			// Received bytes not yet handled
+	size_t in_len;
+	size_t in_capacity;
+	t_message **queue; // Ring of pending messages
+	int queue_head;
+	int queue_count;
+	int queue_capacity;
+	size_t queue_sent;	// Bytes of the oldest message already sent
+	size_t queue_bytes; // Bytes queued and not sent yet
+} t_link;
+
+/**
+ * @brief Messages already seen from one origin node, to drop duplicates.
+ *
+ * Bit i of `seen` stands for sequence number seq - i. A node restarting
+ * comes back with a higher incarnation and starts its sequence over.
+ */
+typedef struct s_origin
+{
+	uint64_t incarnation; // 0 until a message from the node arrived
+	uint64_t seq; // Highest sequence number seen
+	uint64_t seen;
+} t_origin;
+
+/**
+ * @brief What a client timer is for.
+ */
+typedef enum e_timer_kind
+{
+	TIMER_IDLE,		 // Nothing received for -i seconds
+	TIMER_HEARTBEAT, // Nothing received for -k seconds: ping
+	TIMER_FLUSH		 // Queued messages not taken by the socket for -D seconds
+} t_timer_kind;
+
+/**
+ * @brief A timer, embedded in the client it belongs to.
+ *
+ * Linked into one slot of its shard's wheel while armed; `pprev` points at
+ * the link to it, so it is removed in O(1) without knowing the slot.
+ */
+typedef struct s_timer
+{
+	struct s_timer *next;
+	struct s_timer **pprev; // NULL while not armed
+	uint64_t expires;		// Tick
+	t_timer_kind kind;
+} t_timer;
+
+/**
+ * @brief Hierarchical timer wheel of one shard.
+ *
+ * Level 0 has a slot per tick for the next 64 ticks, level l a slot per
+ * 64^l ticks. Arming and cancelling are O(1); a level l > 0 slot is
+ * cascaded down to the lower levels when the wheel reaches its first tick.
+ * Timers are only checked once per tick, so expiries are rounded up to
+ * TIMER_TICK_MS.
+ */
+typedef struct s_wheel
+{
+	t_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t now; // Last tick processed
+	int armed;
+} t_wheel;
+
+/**
+ * @brief A watched fd. Clients also carry their session state.
+ *
+ * Messages that could not be sent right away are kept in `queue` (allocated
+ * on first use, grown up to OUTQ_MAX entries) and flushed when the socket
+ * becomes writable again, resuming exactly where a partial send stopped.
+ *
+ * Client sessions come from their shard's slab pool and go back to it on
+ * disconnect with their buffers still attached, so a reconnecting client
+ * reuses them without touching the heap.
+ */
+typedef struct s_client
+{
+	t_conn_kind kind;
+	int fd;
+	int slot;			// Index in the shard's fds/clients arrays
+	t_message **queue;	// Ring of pending messages, NULL until needed
+	int queue_head;		// Index of the oldest pending message
+	int queue_count;	// Number of pending messages
+	int queue_capacity; // Allocated ring entries
+	size_t queue_sent;	// Bytes of the oldest message already sent
+	size_t queue_bytes; // Bytes queued and not sent yet
+	bool evicted;		// Disconnected as a slow consumer, waiting for EOF
+	bool dirty;			// Waiting for the end-of-iteration flush
+	char *in;			// Reassembly buffer for a frame split across reads
+	size_t in_len;		// Bytes of that frame received so far
+	size_t in_capacity; // Allocated size of `in`
+	int pending_ops;	// io_uring: requests whose last completion is pending
+	bool sending;		// io_uring: a sendmsg is in flight
+	bool closing;		// io_uring: detached, freed once pending_ops is 0
+	struct iovec *send_iov;
+	struct msghdr send_msg;
+	t_room *room;				// Room the client talks in, NULL until registered
+	int room_slot;				// Index in room->members
+	struct in6_addr peer;		// Source address, IPv4-mapped for IPv4
+	bool peer_counted;			// Holds one of peer's connections in the -c table
+	uint64_t last_rx;			// Tick of the last read, for TIMER_IDLE and TIMER_HEARTBEAT
+	uint64_t last_tx;			// Tick of the last write, for TIMER_FLUSH
+	t_timer idle_timer;
+	t_timer heartbeat_timer;
+	t_timer flush_timer;
+	struct s_client *next_free; // Pool free list link while unused
+} t_client;
+
+/**
+ * @brief One mapped file of the history log.
+ *
+ * Segments are appended to until full, then the next one is created and
+ * the one HISTORY_SEGMENTS behind it deleted. A segment stays mapped while
+ * it is the current one or while a history message points into it, even
+ * once its file is gone.
+ */
+typedef struct s_segment
+{
+	atomic_int refs;
+	int fd;
+	unsigned seq; // File name is history.<seq>
+	char *base;
+	size_t used; // Bytes of records written
+} t_segment;
+
+/**
+ * @brief Header of a record in a history segment, followed by the frame.
+ *
+ * `len` is written last, so a record cut short by a crash reads as the
+ * end of the log.
+ */
+typedef struct s_record
+{
+	uint32_t len;		// Whole record, header included, 8-byte aligned; 0 ends the log
+	uint32_t frame_len; // Frame bytes after the header
+	int64_t time;		// Wall clock seconds when it was relayed
+	bool to_room;
+	char room[ROOM_NAME_MAX + 1];
+} t_record;
+
+/**
+ * @brief Counters of one shard, exported on the admin port.
+ *
+ * Only the owning shard writes them, so an update is a relaxed load and
+ * store rather than a locked read-modify-write; the admin thread reads them
+ * concurrently and sums all shards. Gauges are derived as differences of
+ * two counters (e.g. connections = accepts - disconnects).
+ */
+typedef struct s_metrics
+{
+	atomic_ulong accepts;
+	atomic_ulong rejected_ip;	// Connections over the -c limit of their address
+	atomic_ulong rejected_full; // Connections refused for lack of fds or sessions
+	atomic_ulong disconnects;
+	atomic_ulong frames_in;	   // Frames received from clients
+	atomic_ulong messages_out; // Messages completely written to a client
+	atomic_ulong bytes_in;
+	atomic_ulong bytes_out;
+	atomic_ulong queued;   // Messages put on a client's outbound ring...
+	atomic_ulong dequeued; // ...and taken off it, sent or dropped
+	atomic_ulong outbound_bytes; // Bytes queued for this shard's clients
+	atomic_ulong slow_dropped;	 // Slow-consumer policy: messages dropped (oldest)
+	atomic_ulong slow_skipped;	 // Slow-consumer policy: messages not queued
+	atomic_ulong slow_evicted;	 // Slow-consumer policy: clients disconnected
+	atomic_ulong queue_full;	 // Messages lost because a ring reached OUTQ_MAX
+	atomic_ulong slow_deadline;	 // Clients disconnected by their flush deadline
+	atomic_ulong idle_timeouts;	 // Clients disconnected for not sending anything
+	atomic_ulong heartbeats;	 // FRAME_PING sent
+	atomic_ulong flushes;		 // Coalesced writes, one per dirty client per flush
+	atomic_ulong wakeups;  // Returns from poll/epoll_wait/io_uring_enter
+	atomic_ulong syscalls; // Event loop system calls, for backend comparisons
+	atomic_ulong fanout_ns;	// Sum of fan-out latencies
+	atomic_ulong fanout[LATENCY_BUCKETS + 1]; // Latency histogram, last is +Inf
+} t_metrics;
+
+/**
+ * @brief State of one event-loop thread (shard).
+ *
+ * fds holds every watched fd (listener, stdin, wakeup eventfd, clients) and
+ * is what poll() waits on; clients[i] is the connection behind fds[i] and the
+ * list of recipients for broadcasts in both backends. Only the owning thread
+ * touches them; other shards hand messages over through the inbox, guarded by
+ * inboxLock and signalled on wakeFd. The drained inbox is swapped with
+ * `spare`, so steady-state hand-over does not allocate. `rooms` is a chained
+ * hash table of this shard's rooms, with rooms_mask + 1 buckets. `dirty`
+ * lists the clients with messages queued since the last flush; `wheel` holds
+ * the timers of this shard's clients and bounds how long the loop waits.
+ */
+typedef struct s_server
+{
+	int id;
+	t_backend backend;
+	int serverFd;
+	int reserveFd; // Spare fd, given up to shed connections when out of fds
+	int epollFd;
+	int wakeFd;
+	t_client listener;
+	t_client wakeup;
+	t_client input;
+	struct pollfd *fds;
+	t_client **clients;
+	int fds_count;
+	int fds_capacity; // Fixed at startup, the arrays are never reallocated
+	t_client *free_sessions;
+	t_room **rooms;
+	unsigned rooms_mask;
+	int rooms_count;
+	pthread_t thread;
+	pthread_mutex_t inboxLock;
+	t_message **inbox;
+	int inbox_count;
+	int inbox_capacity;
+	t_message **spare;
+	int spare_capacity;
+	t_client **dirty;
+	int dirty_count;
+	int dirty_capacity;
+	uint64_t dirty_since; // When the first client of the batch became dirty
+	uint64_t tick; // Wheel tick read when the last wait returned, for timestamps
+	t_wheel wheel;
+	t_message *ping; // Shared FRAME_PING, kept for the shard's lifetime
+	t_uring uring;
+	t_metrics metrics;
+} t_server;
 
 // Global variables for input line management
 static char current_input[BUFFER_SIZE] = {0};
 static int input_pos = 0;
 static struct termios orig_termios;
 
+// Serializes terminal output and input line edits across shards. Recursive:
+// the operator's input handler broadcasts while holding it, and sends may log.
+static pthread_mutex_t tty_lock;
+
+// Headless mode: no terminal, log lines are appended to log_buffer and
+// written out by the log thread, which swaps in the other buffer first so
+// writers never wait on output; lines that do not fit are only counted.
+static bool headless = false;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static char log_buffers[2][LOG_BUFFER_SIZE];
+static char *log_buffer = log_buffers[0];
+static size_t log_len = 0;
+static unsigned long log_dropped = 0;
+
+// Listener settings
+static int listen_family = AF_INET;
+static bool listen_dual = false;
+static int listen_backlog = BACKLOG;
+
+// Connections per source address, for every shard: SO_REUSEPORT spreads one
+// address's connections over all of them
+static int conns_per_ip = 0; // -c, 0 is unlimited
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+static t_peer **peers = NULL;
+static unsigned peers_mask = 0;
+static int peers_count = 0;
+
+// Slow-consumer limits; the global one is split evenly between shards
+static size_t client_outq_bytes = CLIENT_OUTQ_BYTES;
+static size_t global_outq_bytes = GLOBAL_OUTQ_BYTES;
+static size_t shard_outq_bytes = GLOBAL_OUTQ_BYTES;
+static t_slow_policy slow_policy = SLOW_DROP_OLDEST;
+static uint64_t batch_window_ns = 0; // -w: how long queued messages may wait
+// Client timeouts, in ticks; 0 is off
+static uint64_t idle_ticks = 0;
+static uint64_t heartbeat_ticks = 0;
+static uint64_t flush_deadline_ticks = FLUSH_DEADLINE * 1000 / TIMER_TICK_MS;
+
+// Cluster (-N, -L, -R): everything but relay_inbox is the relay thread's
+static unsigned node_id = 0; // 0: standalone
+static uint64_t incarnation = 0;
+static t_relay relays[MAX_RELAYS];
+static int relays_count = 0;
+static t_link links[MAX_LINKS];
+static t_origin origins[MAX_NODES + 1]; // Indexed by node id
+static uint64_t relay_seq = 0;
+static pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
+static t_message **relay_inbox = NULL; // Messages of local clients, for the relay thread
+static int relay_inbox_count = 0;
+static int relay_inbox_capacity = 0;
+static int relay_wake_fd = -1;
+static atomic_ulong relay_links_up;
+static atomic_ulong relay_links_down;
+static atomic_ulong relay_sent;		  // Messages queued on a link
+static atomic_ulong relay_received;	  // Messages from other nodes delivered here
+static atomic_ulong relay_duplicates; // Messages that came back or arrived twice
+
+// Message history (-H), shared by all shards. history_lock guards the
+// current segment and the ring of the last HISTORY_RING messages, each
+// a header-less message pointing into its segment.
+static const char *history_dir = NULL;
+static int history_replay = HISTORY_REPLAY;
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static t_segment *history_segment = NULL;
+static t_message *history_ring[HISTORY_RING];
+static int history_head = 0; // Oldest entry
+static int history_count = 0;
+
+// All shards, shard 0 runs on the main thread and owns stdin
+static t_server *shards = NULL;
+static int shards_count = 1;
+
+// Set by SIGINT/SIGTERM, which also wake shard 0: it shuts down from its
+// loop, so exit() and the atexit hooks never run in signal context
+static volatile sig_atomic_t interrupted = 0;
+
+// Upper bounds of the fan-out latency buckets, in microseconds
+static const unsigned long latency_bounds_us[LATENCY_BUCKETS] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000};
+
+// Client sessions indexed by fd. fds are unique process-wide, so shards share
+// the table; each entry is only written by the shard owning that fd.
+static t_client **sessions = NULL;
+static int sessions_max = 0;
+
 /**
  * @brief Extracts pointer to IPv4 or IPv6 address from sockaddr.
  */
@@ -56,6 +645,8 @@ void enable_raw_mode(void)
  */
 void disable_raw_mode(void)
 {
+	if (headless)
+		return;
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios) == -1)
 	{
 		perror("ChatServer: disable_raw_mode: tcsetattr()");
@@ -73,14 +664,129 @@ void redraw_input_line(void)
 }
 
 /**
- * @brief Signal handler to restore terminal mode
+ * @brief Log one line (without trailing newline).
+ *
+ * On a terminal the line is printed above the operator's input line, which
+ * is then redrawn. Headless, it is only copied into the log buffer; the log
+ * thread does the actual write, so the event loop never waits on output.
+ */
+void logLine(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (!headless)
+	{
+		pthread_mutex_lock(&tty_lock);
+		printf("\r\033[2K");
+		vprintf(fmt, ap);
+		printf("\n");
+		redraw_input_line();
+		pthread_mutex_unlock(&tty_lock);
+		va_end(ap);
+		return;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	size_t room = LOG_BUFFER_SIZE - log_len;
+	int n = vsnprintf(log_buffer + log_len, room, fmt, ap);
+	if (n >= 0 && (size_t)n + 1 < room)
+	{
+		log_len += n;
+		log_buffer[log_len++] = '\n';
+	}
+	else
+		log_dropped++;
+	// Past half full, do not wait for the next periodic flush
+	if (log_len > LOG_BUFFER_SIZE / 2)
+		pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_lock);
+	va_end(ap);
+}
+
+/**
+ * @brief Write log lines to stdout, then report lines lost to a full buffer.
+ */
+void writeLog(const char *buf, size_t len, unsigned long dropped)
+{
+	size_t done = 0;
+
+	while (done < len)
+	{
+		ssize_t n = write(STDOUT_FILENO, buf + done, len - done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	if (dropped > 0)
+		dprintf(STDOUT_FILENO, "ChatServer: log buffer full, %lu lines dropped\n", dropped);
+}
+
+/**
+ * @brief Write out what is left in the log buffer, before exiting.
+ */
+void flushLog(void)
+{
+	pthread_mutex_lock(&log_lock);
+	writeLog(log_buffer, log_len, log_dropped);
+	log_len = 0;
+	log_dropped = 0;
+	pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * @brief Log thread for headless mode: every LOG_FLUSH_MS (or sooner when
+ * the buffer fills up) swaps the buffers and writes out the full one.
+ */
+void *logThread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&log_lock);
+	while (true)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&log_cond, &log_lock, &deadline);
+		if (log_len == 0 && log_dropped == 0)
+			continue;
+
+		char *full = log_buffer;
+		size_t len = log_len;
+		unsigned long dropped = log_dropped;
+		log_buffer = (full == log_buffers[0]) ? log_buffers[1] : log_buffers[0];
+		log_len = 0;
+		log_dropped = 0;
+		pthread_mutex_unlock(&log_lock);
+		writeLog(full, len, dropped);
+		pthread_mutex_lock(&log_lock);
+	}
+	return (NULL);
+}
+
+/**
+ * @brief SIGINT/SIGTERM handler: flag the shutdown and wake shard 0.
+ *
+ * Only async-signal-safe calls here; exiting from the handler could
+ * deadlock on a lock the interrupted code holds (flushLog's log_lock).
  */
 void signal_handler(int sig)
 {
+	int saved = errno;
+	eventfd_t one = 1;
+
 	(void)sig; // Suppress unused parameter warning
-	disable_raw_mode();
-	printf("\nChatServer: interrupted, shutting down...\n");
-	exit(EXIT_SUCCESS);
+	interrupted = 1;
+	ssize_t rc = write(shards[0].wakeFd, &one, sizeof(one));
+	(void)rc; // Nothing to do about it in a signal handler
+	errno = saved;
 }
 
 /**
@@ -97,325 +803,3750 @@ const char *inet_ntop2(const struct sockaddr *sa, char *out, socklen_t outlen)
 	return (inet_ntop(sa->sa_family, addr, out, outlen));
 }
 
-void addNewConnection(int serverFd, struct pollfd **fds, int *fds_count, int *fds_capacity)
+/**
+ * @brief Put a file descriptor into non-blocking mode.
+ * @return 0 on success, -1 on failure
+ */
+int set_nonblocking(int fd)
 {
-	struct sockaddr_storage clientAddr;
-	socklen_t addrLen = sizeof(clientAddr);
-	int newFd = accept(serverFd, (struct sockaddr *)&clientAddr, &addrLen);
-	if (newFd == -1)
-	{
-		perror("ChatServer: addNewConnection: accept()");
-		return;
-	}
+	int flags = fcntl(fd, F_GETFL, 0);
 
-	// Get client IP address for logging
-	char clientIP[INET6_ADDRSTRLEN];
-	if (!inet_ntop2((struct sockaddr *)&clientAddr, clientIP, sizeof(clientIP)))
-		strcpy(clientIP, "?");
+	if (flags == -1)
+		return (-1);
+	return (fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
 
-	if (*fds_count >= *fds_capacity)
-	{
-		*fds_capacity *= 2;
-		*fds = realloc(*fds, *fds_capacity * sizeof(struct pollfd));
-		if (*fds == NULL)
-		{
-			perror("ChatServer: addNewConnection: realloc()");
-			close(newFd);
-			exit(EXIT_FAILURE);
-		}
-	}
+/**
+ * @brief Write a frame header for a payload of `len` bytes.
+ */
+void putFrameHeader(unsigned char *hdr, uint8_t type, uint32_t len)
+{
+	uint32_t netlen = htonl(len);
 
-	(*fds)[*fds_count].fd = newFd;
-	(*fds)[*fds_count].events = POLLIN;
-	(*fds_count)++;
-	printf("\nChatServer: new connection from %s (fd %d)\n", clientIP, newFd);
-	printf("Server: ");
-	fflush(stdout);
+	memcpy(hdr, &netlen, sizeof(netlen));
+	hdr[4] = type;
 }
 
 /**
- * @brief Handle server input character by character
+ * @brief Read the payload length out of a frame header.
  */
-void handleServerInput(int serverFd, struct pollfd **fds, int *fds_count)
+uint32_t frameLength(const unsigned char *hdr)
 {
-	char c;
-	ssize_t n = read(STDIN_FILENO, &c, 1);
-
-	if (n <= 0)
-	{
-		printf("\nChatServer: shutting down...\n");
-		disable_raw_mode();
-		exit(EXIT_SUCCESS);
-	}
+	uint32_t netlen;
 
-	// Handle Ctrl+D (EOF - ASCII 4) - using portable helper
-	if (c == 4)
-	{
-		printf("\nChatServer: shutting down...\n");
-		disable_raw_mode();
-		exit(EXIT_SUCCESS);
-	}
+	memcpy(&netlen, hdr, sizeof(netlen));
+	return (ntohl(netlen));
+}
 
-	if (c == '\n' || c == '\r')
-	{
-		// Send the message
-		if (input_pos > 0)
-		{
-			// Check for server commands (need full word match)
-			current_input[input_pos] = '\0'; // Temporarily null-terminate for comparison
-			if ((strcmp(current_input, "exit") == 0) || (strcmp(current_input, "quit") == 0))
-			{
-				printf("\nChatServer: shutting down...\n");
-				disable_raw_mode();
-				exit(EXIT_SUCCESS);
-			}
+/**
+ * @brief Add to a counter owned by the calling shard.
+ */
+static inline void metricAdd(atomic_ulong *counter, unsigned long n)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+						  memory_order_relaxed);
+}
 
-			// clear the chat (for the server and clients)
-			if (strcmp(current_input, "clear") == 0)
-			{
-				for (int i = 0; i < *fds_count; i++)
-				{
-					if ((*fds)[i].fd != serverFd && (*fds)[i].fd != STDIN_FILENO)
-					{
-						if (send((*fds)[i].fd, "\033c", 4, MSG_NOSIGNAL) == -1)
-							perror("ChatServer: handleServerInput: send()");
-					}
-				}
-				printf("\033c"); // Clear terminal
-				input_pos = 0;
-				memset(current_input, 0, sizeof(current_input));
-				printf("Server: ");
-				fflush(stdout);
-				return;
-			}
+/**
+ * @brief Read a counter of any shard.
+ */
+static inline unsigned long metricGet(atomic_ulong *counter)
+{
+	return (atomic_load_explicit(counter, memory_order_relaxed));
+}
 
-			// Send message to all clients
-			char message[BUFFER_SIZE + 15];
-			current_input[input_pos] = '\n';
-			snprintf(message, sizeof(message), "Server: %.*s", input_pos + 1, current_input);
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t nowNs(void)
+{
+	struct timespec ts;
 
-			for (int i = 0; i < *fds_count; i++)
-			{
-				if ((*fds)[i].fd != serverFd && (*fds)[i].fd != STDIN_FILENO)
-				{
-					if (send((*fds)[i].fd, message, strlen(message), MSG_NOSIGNAL) == -1)
-						perror("ChatServer: handleServerInput: send()");
-				}
-			}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
 
-			// Clear input buffer
-			input_pos = 0;
-			memset(current_input, 0, sizeof(current_input));
-		}
-		printf("\nServer: ");
-		fflush(stdout);
-	}
-	else if (c == 127 || c == '\b') // Backspace
-	{
-		if (input_pos > 0)
-		{
-			input_pos--;
-			current_input[input_pos] = '\0';
-			redraw_input_line();
-			printf(" \b"); // Clear the deleted character
-			fflush(stdout);
-		}
-	}
-	else if (c >= 32 && c <= 126 && input_pos < BUFFER_SIZE - 2) // Printable characters
-	{
-		current_input[input_pos++] = c;
-		printf("%c", c);
-		fflush(stdout);
-	}
+/**
+ * @brief Current CLOCK_MONOTONIC time in timer wheel ticks.
+ */
+uint64_t nowTick(void)
+{
+	return (nowNs() / (TIMER_TICK_MS * 1000000ULL));
 }
 
-void handleClientMessage(int serverFd, struct pollfd **fds,
-						 int *fds_count, int *fds_capacity, int *fd_i)
+/**
+ * @brief Put an unlinked timer in the slot its expiry falls in.
+ *
+ * The level is the first one whose span, counted from the wheel's current
+ * tick, reaches the expiry; timers beyond the last level are clamped to it.
+ */
+void timerLink(t_wheel *wheel, t_timer *timer)
 {
-	char buffer[BUFFER_SIZE];
-	int clientFd = (*fds)[*fd_i].fd;
-	ssize_t bytesRead = recv(clientFd, buffer, sizeof(buffer), 0);
-	if (bytesRead <= 0)
-	{
-		if (bytesRead == 0)
-			printf("\nChatServer: client with fd %d disconnected\n", clientFd);
-		else
-			perror("ChatServer: handleClientMessage: recv()");
-		close(clientFd);
-		// Remove the client from the fds array by replacing it with the last one
-		(*fds)[*fd_i] = (*fds)[--(*fds_count)];
-		// Decrement fd_i to re-check this position (which now has a different client)
-		(*fd_i)--;
-		if (*fds_count < *fds_capacity / 4)
-		{
-			*fds_capacity /= 2;
-			*fds = realloc(*fds, *fds_capacity * sizeof(struct pollfd));
-			if (*fds == NULL)
-			{
-				perror("ChatServer: handleClientMessage: realloc()");
-				return;
-			}
-		}
-		printf("Server: ");
-		fflush(stdout);
-		return;
-	}
+	uint64_t delta = timer->expires - wheel->now;
+	int level = 0;
 
-	char message[BUFFER_SIZE + 15];
-	sprintf(message, "Client %d: %.*s", clientFd, (int)bytesRead, buffer);
-	printf("\r\033[2K%s", message);
-	redraw_input_line();
-	// Send to all Connections except sender/server socket, and STDIN
-	for (int i = 0; i < *fds_count; i++)
+	if (delta >= 1ULL << (WHEEL_BITS * WHEEL_LEVELS))
 	{
-		if ((*fds)[i].fd != clientFd && (*fds)[i].fd != serverFd && (*fds)[i].fd != STDIN_FILENO)
-		{
-			if (send((*fds)[i].fd, message, strlen(message), MSG_NOSIGNAL) == -1)
-				perror("ChatServer: handleClientMessage: send()");
-		}
+		delta = (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+		timer->expires = wheel->now + delta;
 	}
+	while (delta >= 1ULL << (WHEEL_BITS * (level + 1)))
+		level++;
+
+	t_timer **slot = &wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+	timer->next = *slot;
+	if (*slot != NULL)
+		(*slot)->pprev = &timer->next;
+	*slot = timer;
+	timer->pprev = slot;
 }
 
-void polling(int serverFd, struct pollfd **fds, int *fds_count, int *fds_capacity, int polls)
-{
+/**
+ * @brief Take a timer out of its slot, if it is armed.
+ */
+void timerCancel(t_wheel *wheel, t_timer *timer)
+{
+	if (timer->pprev == NULL)
+		return;
+	*timer->pprev = timer->next;
+	if (timer->next != NULL)
+		timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+	wheel->armed--;
+}
+
+/**
+ * @brief (Re)arm a timer to expire at tick `expires`, at the earliest on the
+ * next tick.
+ */
+void timerArm(t_wheel *wheel, t_timer *timer, uint64_t expires)
+{
+	timerCancel(wheel, timer);
+	timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+	timerLink(wheel, timer);
+	wheel->armed++;
+}
+
+/**
+ * @brief Ticks until the next timer may expire, or UINT64_MAX if none is armed.
+ *
+ * Level 0 holds every timer of the next 63 ticks, one tick per slot. Later
+ * timers sit on higher levels and only need attention when the next one is
+ * cascaded, at the start of the next 64-tick round at the latest.
+ */
+uint64_t timerNext(t_wheel *wheel)
+{
+	if (wheel->armed == 0)
+		return (UINT64_MAX);
+	uint64_t round = (wheel->now | (WHEEL_SLOTS - 1)) + 1;
+	for (uint64_t tick = wheel->now + 1; tick < round; tick++)
+	{
+		if (wheel->slots[0][tick & (WHEEL_SLOTS - 1)] != NULL)
+			return (tick - wheel->now);
+	}
+	return (round - wheel->now);
+}
+
+/**
+ * @brief Record how long a message took from creation until this shard
+ * queued or sent it to all its recipients.
+ */
+void observeFanout(t_metrics *metrics, uint64_t born_ns)
+{
+	uint64_t ns = nowNs() - born_ns;
+	int b = 0;
+
+	while (b < LATENCY_BUCKETS && ns > latency_bounds_us[b] * 1000)
+		b++;
+	metricAdd(&metrics->fanout[b], 1);
+	metricAdd(&metrics->fanout_ns, ns);
+}
+
+/**
+ * @brief Build a frame from a text prefix and a payload in one allocation.
+ * @param prefix Text sent before the payload, e.g. "Client 5: "
+ * @return the message with one reference held by the caller, NULL on failure
+ */
+t_message *newMessage(uint8_t type, const char *prefix, const char *data, size_t len)
+{
+	t_message *msg = malloc(sizeof(t_message) + len);
+
+	if (msg == NULL)
+	{
+		perror("ChatServer: newMessage: malloc()");
+		return (NULL);
+	}
+	atomic_init(&msg->refs, 1);
+	msg->born_ns = nowNs();
+	size_t prefix_len = strlen(prefix);
+	if (prefix_len > HEADER_SIZE - FRAME_HEADER_SIZE)
+		prefix_len = HEADER_SIZE - FRAME_HEADER_SIZE;
+	putFrameHeader((unsigned char *)msg->header, type, prefix_len + len);
+	memcpy(msg->header + FRAME_HEADER_SIZE, prefix, prefix_len);
+	msg->header_len = FRAME_HEADER_SIZE + prefix_len;
+	msg->len = len;
+	msg->ext = NULL;
+	msg->segment = NULL;
+	msg->critical = false;
+	msg->to_room = false;
+	msg->room[0] = '\0';
+	memcpy(msg->data, data, len);
+	return (msg);
+}
+
+/**
+ * @brief Drop a reference on a history segment; unmaps it on the last one.
+ *
+ * The file itself stays until removeSegment() deletes it.
+ */
+void releaseSegment(t_segment *seg)
+{
+	if (atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) != 1)
+		return;
+	munmap(seg->base, SEGMENT_SIZE);
+	close(seg->fd);
+	free(seg);
+}
+
+/**
+ * @brief Take an extra reference on a message.
+ */
+t_message *retainMessage(t_message *msg)
+{
+	atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+	return (msg);
+}
+
+/**
+ * @brief Drop a reference; frees the message when it was the last one.
+ */
+void releaseMessage(t_message *msg)
+{
+	if (atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1)
+	{
+		if (msg->segment != NULL)
+			releaseSegment(msg->segment);
+		free(msg);
+	}
+}
+
+/**
+ * @brief Fill iovecs for a message, skipping the first `skip` bytes.
+ * @return number of iovecs written (0, 1 or 2)
+ */
+int messageIov(const t_message *msg, size_t skip, struct iovec *iov)
+{
+	int n = 0;
+
+	if (skip < msg->header_len)
+	{
+		iov[n].iov_base = (char *)msg->header + skip;
+		iov[n++].iov_len = msg->header_len - skip;
+		skip = 0;
+	}
+	else
+		skip -= msg->header_len;
+	if (skip < msg->len)
+	{
+		iov[n].iov_base = (char *)(msg->ext != NULL ? msg->ext : msg->data) + skip;
+		iov[n++].iov_len = msg->len - skip;
+	}
+	return (n);
+}
+
+/**
+ * @brief Open (creating it if needed) and map history segment `seq`.
+ * @return the segment with one reference, or NULL on failure
+ */
+t_segment *openSegment(unsigned seq)
+{
+	char path[PATH_MAX];
+	t_segment *seg = calloc(1, sizeof(t_segment));
+
+	if (seg == NULL)
+		return (NULL);
+	snprintf(path, sizeof(path), "%s/history.%08u", history_dir, seq);
+	seg->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (seg->fd == -1 || ftruncate(seg->fd, SEGMENT_SIZE) == -1)
+	{
+		perror("ChatServer: openSegment()");
+		if (seg->fd != -1)
+			close(seg->fd);
+		free(seg);
+		return (NULL);
+	}
+	seg->base = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+	if (seg->base == MAP_FAILED)
+	{
+		perror("ChatServer: openSegment: mmap()");
+		close(seg->fd);
+		free(seg);
+		return (NULL);
+	}
+	atomic_init(&seg->refs, 1);
+	seg->seq = seq;
+	return (seg);
+}
+
+/**
+ * @brief Delete the file of history segment `seq`, if any.
+ *
+ * Messages still mapped from it stay readable until released.
+ */
+void removeSegment(unsigned seq)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/history.%08u", history_dir, seq);
+	if (unlink(path) == -1 && errno != ENOENT)
+		perror("ChatServer: removeSegment: unlink()");
+}
+
+/**
+ * @brief Index a record of the current segment in the history ring.
+ * Called with history_lock held.
+ */
+void indexRecord(const t_record *rec)
+{
+	t_message *msg = malloc(sizeof(t_message));
+
+	if (msg == NULL)
+		return;
+	atomic_init(&msg->refs, 1);
+	msg->born_ns = nowNs();
+	msg->ext = (const char *)(rec + 1);
+	msg->segment = history_segment;
+	atomic_fetch_add_explicit(&history_segment->refs, 1, memory_order_relaxed);
+	msg->header_len = 0;
+	msg->len = rec->frame_len;
+	msg->to_room = rec->to_room;
+	memcpy(msg->room, rec->room, sizeof(msg->room));
+
+	if (history_count == HISTORY_RING)
+	{
+		releaseMessage(history_ring[history_head]);
+		history_head = (history_head + 1) % HISTORY_RING;
+		history_count--;
+	}
+	history_ring[(history_head + history_count) % HISTORY_RING] = msg;
+	history_count++;
+}
+
+/**
+ * @brief Open the history log in history_dir and index its last segment.
+ *
+ * Appending resumes after the last complete record. Segments beyond the
+ * HISTORY_SEGMENTS newest, e.g. left by an older version, are deleted.
+ * @return 0 on success, -1 on failure
+ */
+int openHistory(void)
+{
+	unsigned last = 0;
+	DIR *dir;
+
+	if (mkdir(history_dir, 0755) == -1 && errno != EEXIST)
+	{
+		perror("ChatServer: openHistory: mkdir()");
+		return (-1);
+	}
+	if ((dir = opendir(history_dir)) == NULL)
+	{
+		perror("ChatServer: openHistory: opendir()");
+		return (-1);
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		unsigned seq;
+		if (sscanf(entry->d_name, "history.%u", &seq) == 1 && seq > last)
+			last = seq;
+	}
+	rewinddir(dir);
+	while ((entry = readdir(dir)) != NULL)
+	{
+		unsigned seq;
+		if (sscanf(entry->d_name, "history.%u", &seq) == 1 && seq + HISTORY_SEGMENTS <= last)
+			removeSegment(seq);
+	}
+	closedir(dir);
+
+	if ((history_segment = openSegment(last)) == NULL)
+		return (-1);
+	while (history_segment->used + sizeof(t_record) <= SEGMENT_SIZE)
+	{
+		t_record *rec = (t_record *)(history_segment->base + history_segment->used);
+		if (rec->len == 0 || rec->len > SEGMENT_SIZE - history_segment->used ||
+			sizeof(t_record) + rec->frame_len > rec->len)
+			break;
+		indexRecord(rec);
+		history_segment->used += rec->len;
+	}
+	return (0);
+}
+
+/**
+ * @brief Append a relayed message to the history log and index it.
+ *
+ * Only a memcpy into the mapped segment: the page cache and the history
+ * thread's periodic fdatasync take care of the disk, so the relay path
+ * never waits on I/O.
+ */
+void historyAppend(const t_message *msg)
+{
+	size_t frame_len = msg->header_len + msg->len;
+	size_t len = (sizeof(t_record) + frame_len + 7) & ~(size_t)7;
+
+	if (history_dir == NULL)
+		return;
+	pthread_mutex_lock(&history_lock);
+	if (history_segment == NULL)
+	{
+		pthread_mutex_unlock(&history_lock);
+		return;
+	}
+	if (history_segment->used + len > SEGMENT_SIZE)
+	{
+		t_segment *next = openSegment(history_segment->seq + 1);
+		if (next == NULL)
+		{
+			pthread_mutex_unlock(&history_lock);
+			return;
+		}
+		releaseSegment(history_segment);
+		history_segment = next;
+		if (next->seq >= HISTORY_SEGMENTS)
+			removeSegment(next->seq - HISTORY_SEGMENTS);
+	}
+
+	t_record *rec = (t_record *)(history_segment->base + history_segment->used);
+	rec->frame_len = frame_len;
+	rec->time = time(NULL);
+	rec->to_room = msg->to_room;
+	memcpy(rec->room, msg->room, sizeof(rec->room));
+	memcpy((char *)(rec + 1), msg->header, msg->header_len);
+	memcpy((char *)(rec + 1) + msg->header_len, msg->data, msg->len);
+	atomic_store_explicit((_Atomic uint32_t *)&rec->len, len, memory_order_release);
+	history_segment->used += len;
+	indexRecord(rec);
+	pthread_mutex_unlock(&history_lock);
+}
+
+/**
+ * @brief History thread: flushes the current segment to disk periodically.
+ */
+void *historyThread(void *arg)
+{
+	(void)arg;
+	while (true)
+	{
+		usleep(HISTORY_SYNC_MS * 1000);
+		pthread_mutex_lock(&history_lock);
+		t_segment *seg = history_segment;
+		atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+		pthread_mutex_unlock(&history_lock);
+		if (fdatasync(seg->fd) == -1)
+			perror("ChatServer: historyThread: fdatasync()");
+		releaseSegment(seg);
+	}
+	return (NULL);
+}
+
+/**
+ * @brief Ask for writability events only while a client has queued data.
+ *
+ * Always watching POLLOUT would wake the loop on every idle, writable socket.
+ */
+void updateInterest(t_server *srv, t_client *client)
+{
+	short events = POLLIN;
+
+	if (client->queue_count > 0)
+		events |= POLLOUT;
+	if (srv->fds[client->slot].events == events)
+		return;
+	srv->fds[client->slot].events = events;
+
+	if (srv->backend == BACKEND_EPOLL)
+	{
+		struct epoll_event ev = {0};
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+		if (client->queue_count > 0)
+			ev.events |= EPOLLOUT;
+		ev.data.ptr = client;
+		metricAdd(&srv->metrics.syscalls, 1);
+		if (epoll_ctl(srv->epollFd, EPOLL_CTL_MOD, client->fd, &ev) == -1)
+			perror("ChatServer: updateInterest: epoll_ctl()");
+	}
+}
+
+/**
+ * @brief Release what a failed uringSetup() created so far.
+ *
+ * `rings` is the SQ/CQ mapping of `ringSize` bytes, `sqesSize` the size of
+ * the SQE array; unset parts are NULL or MAP_FAILED.
+ * @return -1, with errno kept from the failure
+ */
+int uringUnwind(t_uring *ring, void *rings, size_t ringSize, size_t sqesSize)
+{
+	int saved = errno;
+
+	if (ring->br != NULL && ring->br != MAP_FAILED)
+		munmap(ring->br, URING_BUFS * sizeof(struct io_uring_buf));
+	free(ring->bufs);
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, sqesSize);
+	if (rings != NULL && rings != MAP_FAILED)
+		munmap(rings, ringSize);
+	close(ring->fd);
+	*ring = (t_uring){.fd = -1};
+	errno = saved;
+	return (-1);
+}
+
+/**
+ * @brief Create an io_uring instance and register its receive buffer ring.
+ *
+ * Needs multishot accept/recv and provided buffer rings (Linux 6.0+).
+ * @return 0 on success, -1 if the kernel does not support them
+ */
+int uringSetup(t_uring *ring)
+{
+	struct io_uring_params params = {0};
+
+	*ring = (t_uring){0};
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->fd == -1)
+		return (-1);
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		errno = ENOSYS;
+		return (uringUnwind(ring, NULL, 0, 0));
+	}
+
+	// SQ and CQ rings share one mapping, the SQE array has its own
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ringSize = sqSize > cqSize ? sqSize : cqSize;
+	size_t sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	char *rings = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					   ring->fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED)
+		return (uringUnwind(ring, NULL, 0, 0));
+	ring->sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					  ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		return (uringUnwind(ring, rings, ringSize, sqesSize));
+	ring->sq_head = (unsigned *)(rings + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(rings + params.sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+	// Receive buffers: the kernel picks one per completion, we hand it back
+	ring->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->bufs = malloc((size_t)URING_BUFS * RECV_SIZE);
+	if (ring->br == MAP_FAILED || ring->bufs == NULL)
+		return (uringUnwind(ring, rings, ringSize, sqesSize));
+	struct io_uring_buf_reg reg = {0};
+	reg.ring_addr = (unsigned long)ring->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return (uringUnwind(ring, rings, ringSize, sqesSize));
+	ring->br_tail = 0;
+	for (int b = 0; b < URING_BUFS; b++)
+	{
+		struct io_uring_buf *buf = &ring->br->bufs[b];
+		buf->addr = (unsigned long)(ring->bufs + (size_t)b * RECV_SIZE);
+		buf->len = RECV_SIZE;
+		buf->bid = b;
+	}
+	ring->br_tail = URING_BUFS;
+	atomic_store_explicit((_Atomic unsigned short *)&ring->br->tail, ring->br_tail, memory_order_release);
+	return (0);
+}
+
+/**
+ * @brief Give a receive buffer back to the kernel.
+ */
+void uringRecycle(t_uring *ring, unsigned short bid)
+{
+	struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_BUFS - 1)];
+
+	buf->addr = (unsigned long)(ring->bufs + (size_t)bid * RECV_SIZE);
+	buf->len = RECV_SIZE;
+	buf->bid = bid;
+	ring->br_tail++;
+	atomic_store_explicit((_Atomic unsigned short *)&ring->br->tail, ring->br_tail, memory_order_release);
+}
+
+/**
+ * @brief Submit queued SQEs and optionally wait for one completion.
+ * @param timeout Longest wait, NULL to wait for a completion however long
+ * @return 0 on success (including a timeout), -1 on failure
+ */
+int uringEnter(t_server *srv, bool wait, const struct timespec *timeout)
+{
+	t_uring *ring = &srv->uring;
+	unsigned toSubmit = ring->sqe_tail - *ring->sq_tail;
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg = {0};
+
+	atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, ring->sqe_tail, memory_order_release);
+	if (toSubmit == 0 && !wait)
+		return (0);
+	if (wait && timeout != NULL)
+	{
+		ts = (struct __kernel_timespec){.tv_sec = timeout->tv_sec, .tv_nsec = timeout->tv_nsec};
+		arg.ts = (unsigned long)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+	metricAdd(&srv->metrics.syscalls, 1);
+	if (syscall(__NR_io_uring_enter, ring->fd, toSubmit, wait ? 1 : 0, flags,
+				timeout != NULL ? (void *)&arg : NULL, timeout != NULL ? sizeof(arg) : 0) == -1 &&
+		errno != EINTR && errno != ETIME)
+		return (-1);
+	return (0);
+}
+
+/**
+ * @brief Get a zeroed SQE, submitting the queue first if it is full.
+ */
+struct io_uring_sqe *uringSqe(t_server *srv, t_client *conn, t_uring_op op)
+{
+	t_uring *ring = &srv->uring;
+
+	while (ring->sqe_tail - atomic_load_explicit((_Atomic unsigned *)ring->sq_head,
+												 memory_order_acquire) > ring->sq_mask)
+	{
+		if (uringEnter(srv, false, NULL) == -1)
+			perror("ChatServer: uringSqe: io_uring_enter()");
+	}
+	unsigned idx = ring->sqe_tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	*sqe = (struct io_uring_sqe){0};
+	sqe->user_data = (unsigned long)conn | op;
+	ring->sq_array[idx] = idx;
+	ring->sqe_tail++;
+	if (conn != NULL && op != UOP_NONE)
+		conn->pending_ops++;
+	return (sqe);
+}
+
+/**
+ * @brief Arm the multishot request that reports events on a connection.
+ */
+void uringArm(t_server *srv, t_client *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	if (conn->kind == CONN_LISTENER)
+	{
+		sqe = uringSqe(srv, conn, UOP_ACCEPT);
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	}
+	else if (conn->kind == CONN_CLIENT)
+	{
+		sqe = uringSqe(srv, conn, UOP_RECV);
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+	}
+	else
+	{
+		sqe = uringSqe(srv, conn, UOP_POLL);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->poll32_events = POLLIN;
+	}
+	sqe->fd = conn->fd;
+}
+
+/**
+ * @brief Register a connection with the backend (no-op for poll).
+ * @param events epoll event mask (EPOLLIN, EPOLLET, ...)
+ * @return 0 on success, -1 on failure
+ */
+int watchFd(t_server *srv, t_client *conn, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (srv->backend == BACKEND_URING)
+	{
+		uringArm(srv, conn);
+		return (0);
+	}
+	if (srv->backend != BACKEND_EPOLL)
+		return (0);
+	ev = (struct epoll_event){0};
+	ev.events = events;
+	ev.data.ptr = conn;
+	return (epoll_ctl(srv->epollFd, EPOLL_CTL_ADD, conn->fd, &ev));
+}
+
+/**
+ * @brief Append a connection to the fds/clients arrays.
+ * @return 0 on success, -1 if the shard is full
+ */
+int addFd(t_server *srv, t_client *conn)
+{
+	if (srv->fds_count >= srv->fds_capacity)
+		return (-1);
+	conn->slot = srv->fds_count;
+	srv->fds[srv->fds_count].fd = conn->fd;
+	srv->fds[srv->fds_count].events = POLLIN;
+	srv->fds[srv->fds_count].revents = 0;
+	srv->clients[srv->fds_count] = conn;
+	srv->fds_count++;
+	return (0);
+}
+
+/**
+ * @brief Find the session of a connected client in O(1).
+ *
+ * Safe from any shard for a lookup; only the owning shard may modify it.
+ * @return the session, or NULL if no client owns this fd
+ */
+t_client *findSession(int fd)
+{
+	if (fd < 0 || fd >= sessions_max)
+		return (NULL);
+	return (sessions[fd]);
+}
+
+/**
+ * @brief Take a session from the shard's pool, carving a new slab if empty.
+ * @return a reset session, or NULL if a new slab could not be allocated
+ */
+t_client *allocSession(t_server *srv)
+{
+	if (srv->free_sessions == NULL)
+	{
+		t_client *slab = calloc(SLAB_SESSIONS, sizeof(t_client));
+		if (slab == NULL)
+			return (NULL);
+		for (int i = SLAB_SESSIONS - 1; i >= 0; i--)
+		{
+			slab[i].next_free = srv->free_sessions;
+			srv->free_sessions = &slab[i];
+		}
+	}
+
+	t_client *client = srv->free_sessions;
+	srv->free_sessions = client->next_free;
+	client->next_free = NULL;
+	return (client);
+}
+
+/**
+ * @brief FNV-1a hash of a room name.
+ */
+unsigned roomHash(const char *name)
+{
+	unsigned hash = 2166136261u;
+
+	for (; *name != '\0'; name++)
+		hash = (hash ^ (unsigned char)*name) * 16777619u;
+	return (hash);
+}
+
+/**
+ * @brief Find a room of this shard by name.
+ * @return the room, or NULL if none of the shard's clients is in it
+ */
+t_room *findRoom(t_server *srv, const char *name)
+{
+	t_room *room = srv->rooms[roomHash(name) & srv->rooms_mask];
+
+	while (room != NULL && strcmp(room->name, name) != 0)
+		room = room->next;
+	return (room);
+}
+
+/**
+ * @brief Double the number of buckets of the room index and rehash.
+ * @return 0 on success, -1 on allocation failure (the index is unchanged)
+ */
+int growRooms(t_server *srv)
+{
+	unsigned mask = srv->rooms_mask * 2 + 1;
+	t_room **buckets = calloc(mask + 1, sizeof(t_room *));
+
+	if (buckets == NULL)
+		return (-1);
+	for (unsigned b = 0; b <= srv->rooms_mask; b++)
+	{
+		while (srv->rooms[b] != NULL)
+		{
+			t_room *room = srv->rooms[b];
+			srv->rooms[b] = room->next;
+			room->next = buckets[roomHash(room->name) & mask];
+			buckets[roomHash(room->name) & mask] = room;
+		}
+	}
+	free(srv->rooms);
+	srv->rooms = buckets;
+	srv->rooms_mask = mask;
+	return (0);
+}
+
+/**
+ * @brief Unlink an empty room from the index and free it.
+ */
+void dropRoom(t_server *srv, t_room *room)
+{
+	t_room **link = &srv->rooms[roomHash(room->name) & srv->rooms_mask];
+
+	while (*link != room)
+		link = &(*link)->next;
+	*link = room->next;
+	srv->rooms_count--;
+	free(room->members);
+	free(room);
+}
+
+/**
+ * @brief Take a client out of its room, freeing the room if it empties.
+ */
+void leaveRoom(t_server *srv, t_client *client)
+{
+	t_room *room = client->room;
+
+	if (room == NULL)
+		return;
+	client->room = NULL;
+	// Fill the hole with the last member, like removeConnection does
+	room->members_count--;
+	if (client->room_slot != room->members_count)
+	{
+		room->members[client->room_slot] = room->members[room->members_count];
+		room->members[client->room_slot]->room_slot = client->room_slot;
+	}
+	if (room->members_count == 0)
+		dropRoom(srv, room);
+}
+
+/**
+ * @brief Move a client to a room, creating the room if needed.
+ * @param name Room name, at most ROOM_NAME_MAX bytes; "" is the lobby
+ * @return 0 on success, -1 on allocation failure (the client stays where it was)
+ */
+int joinRoom(t_server *srv, t_client *client, const char *name)
+{
+	t_room *room = findRoom(srv, name);
+
+	if (room != NULL && room == client->room)
+		return (0);
+	if (room == NULL)
+	{
+		if ((unsigned)srv->rooms_count > srv->rooms_mask && growRooms(srv) == -1)
+			return (-1);
+		if ((room = calloc(1, sizeof(t_room))) == NULL)
+			return (-1);
+		snprintf(room->name, sizeof(room->name), "%s", name);
+		unsigned b = roomHash(name) & srv->rooms_mask;
+		room->next = srv->rooms[b];
+		srv->rooms[b] = room;
+		srv->rooms_count++;
+	}
+	if (room->members_count == room->members_capacity)
+	{
+		int capacity = room->members_capacity ? room->members_capacity * 2 : 4;
+		t_client **grown = realloc(room->members, capacity * sizeof(t_client *));
+		if (grown == NULL)
+		{
+			if (room->members_count == 0)
+				dropRoom(srv, room);
+			return (-1);
+		}
+		room->members = grown;
+		room->members_capacity = capacity;
+	}
+	leaveRoom(srv, client);
+	client->room = room;
+	client->room_slot = room->members_count;
+	room->members[room->members_count++] = client;
+	return (0);
+}
+
+/**
+ * @brief Source address of a connection as a peer table key.
+ */
+void peerKey(const struct sockaddr *sa, struct in6_addr *key)
+{
+	memset(key, 0, sizeof(*key));
+	if (sa->sa_family == AF_INET6)
+		*key = ((const struct sockaddr_in6 *)sa)->sin6_addr;
+	else if (sa->sa_family == AF_INET)
+	{
+		key->s6_addr[10] = 0xff;
+		key->s6_addr[11] = 0xff;
+		memcpy(&key->s6_addr[12], &((const struct sockaddr_in *)sa)->sin_addr, 4);
+	}
+}
+
+/**
+ * @brief FNV-1a hash of a peer address.
+ */
+unsigned peerHash(const struct in6_addr *key)
+{
+	unsigned hash = 2166136261u;
+
+	for (int i = 0; i < 16; i++)
+		hash = (hash ^ key->s6_addr[i]) * 16777619u;
+	return (hash);
+}
+
+/**
+ * @brief Double the number of buckets of the peer table and rehash.
+ *
+ * Called with peers_lock held.
+ * @return 0 on success, -1 on allocation failure (the table is unchanged)
+ */
+int growPeers(void)
+{
+	unsigned mask = peers ? peers_mask * 2 + 1 : PEER_BUCKETS - 1;
+	t_peer **buckets = calloc(mask + 1, sizeof(t_peer *));
+
+	if (buckets == NULL)
+		return (-1);
+	for (unsigned b = 0; peers != NULL && b <= peers_mask; b++)
+	{
+		while (peers[b] != NULL)
+		{
+			t_peer *peer = peers[b];
+			peers[b] = peer->next;
+			peer->next = buckets[peerHash(&peer->addr) & mask];
+			buckets[peerHash(&peer->addr) & mask] = peer;
+		}
+	}
+	free(peers);
+	peers = buckets;
+	peers_mask = mask;
+	return (0);
+}
+
+/**
+ * @brief Count a new connection from `key` if its address is under the -c limit.
+ * @return true if the connection may stay
+ */
+bool peerAcquire(const struct in6_addr *key)
+{
+	bool admitted = false;
+
+	pthread_mutex_lock(&peers_lock);
+	if (peers == NULL || peers_count > (int)peers_mask)
+		growPeers();
+	if (peers != NULL)
+	{
+		t_peer **link = &peers[peerHash(key) & peers_mask];
+		while (*link != NULL && memcmp(&(*link)->addr, key, sizeof(*key)) != 0)
+			link = &(*link)->next;
+		if (*link == NULL && (*link = calloc(1, sizeof(t_peer))) != NULL)
+		{
+			(*link)->addr = *key;
+			peers_count++;
+		}
+		if (*link != NULL && (*link)->conns < conns_per_ip)
+		{
+			(*link)->conns++;
+			admitted = true;
+		}
+	}
+	pthread_mutex_unlock(&peers_lock);
+	return (admitted);
+}
+
+/**
+ * @brief Forget a connection counted by peerAcquire(); the entry goes with
+ * the address's last connection.
+ */
+void peerRelease(const struct in6_addr *key)
+{
+	pthread_mutex_lock(&peers_lock);
+	t_peer **link = &peers[peerHash(key) & peers_mask];
+	while (*link != NULL && memcmp(&(*link)->addr, key, sizeof(*key)) != 0)
+		link = &(*link)->next;
+	if (*link != NULL && --(*link)->conns == 0)
+	{
+		t_peer *peer = *link;
+		*link = peer->next;
+		free(peer);
+		peers_count--;
+	}
+	pthread_mutex_unlock(&peers_lock);
+}
+
+/**
+ * @brief Account for bytes added to (delta > 0) or leaving a client's queue.
+ */
+void queueBytes(t_server *srv, t_client *client, long delta)
+{
+	client->queue_bytes += delta;
+	metricAdd(&srv->metrics.outbound_bytes, (unsigned long)delta);
+}
+
+/**
+ * @brief Release every message still queued for a client.
+ */
+void dropQueue(t_server *srv, t_client *client)
+{
+	queueBytes(srv, client, -(long)client->queue_bytes);
+	metricAdd(&srv->metrics.dequeued, client->queue_count);
+	while (client->queue_count > 0)
+	{
+		releaseMessage(client->queue[client->queue_head]);
+		client->queue_head = (client->queue_head + 1) % client->queue_capacity;
+		client->queue_count--;
+	}
+	client->queue_sent = 0;
+}
+
+/**
+ * @brief Account for `sent` bytes written from the head of a client's queue.
+ *
+ * Every message that went out completely is released.
+ */
+void consumeQueue(t_server *srv, t_client *client, size_t sent)
+{
+	size_t done = client->queue_sent + sent;
+
+	metricAdd(&srv->metrics.bytes_out, sent);
+	queueBytes(srv, client, -(long)sent);
+	if (sent > 0)
+		client->last_tx = srv->tick;
+	while (client->queue_count > 0)
+	{
+		t_message *msg = client->queue[client->queue_head];
+		size_t total = msg->header_len + msg->len;
+		if (done < total)
+			break;
+		done -= total;
+		metricAdd(&srv->metrics.messages_out, 1);
+		metricAdd(&srv->metrics.dequeued, 1);
+		releaseMessage(msg);
+		client->queue_head = (client->queue_head + 1) % client->queue_capacity;
+		client->queue_count--;
+	}
+	client->queue_sent = done;
+	if (client->queue_count == 0)
+		timerCancel(&srv->wheel, &client->flush_timer);
+}
+
+/**
+ * @brief Fill iovecs for up to FLUSH_BATCH queued messages.
+ * @return number of iovecs written
+ */
+int queueIov(t_client *client, struct iovec *iov)
+{
+	int iovcnt = 0;
+	size_t skip = client->queue_sent;
+
+	for (int q = 0; q < client->queue_count && q < FLUSH_BATCH; q++)
+	{
+		t_message *msg = client->queue[(client->queue_head + q) % client->queue_capacity];
+		iovcnt += messageIov(msg, skip, iov + iovcnt);
+		skip = 0;
+	}
+	return (iovcnt);
+}
+
+/**
+ * @brief Close a client and return its session to the pool.
+ *
+ * Called once nothing refers to the client anymore. The queue ring and the
+ * iovec array stay allocated for the next client using this session.
+ */
+void freeClient(t_server *srv, t_client *client)
+{
+	// Clear the table entry before close() makes the fd number reusable
+	sessions[client->fd] = NULL;
+	close(client->fd);
+	dropQueue(srv, client);
+	client->queue_head = 0;
+	client->in_len = 0;
+	// Keep the reassembly buffer only if it has the usual size
+	if (client->in_capacity > RECV_SIZE)
+	{
+		free(client->in);
+		client->in = NULL;
+		client->in_capacity = 0;
+	}
+	client->pending_ops = 0;
+	client->sending = false;
+	client->closing = false;
+	client->evicted = false;
+	client->dirty = false;
+	client->next_free = srv->free_sessions;
+	srv->free_sessions = client;
+}
+
+/**
+ * @brief Close a client and remove it from the fds/clients arrays (and epoll set).
+ *
+ * With io_uring the kernel may still hold requests for the client: they are
+ * cancelled and the client is only freed when the last one completes.
+ */
+void removeConnection(t_server *srv, t_client *client)
+{
+	int fd_i = client->slot;
+
+	metricAdd(&srv->metrics.disconnects, 1);
+	leaveRoom(srv, client);
+	timerCancel(&srv->wheel, &client->idle_timer);
+	timerCancel(&srv->wheel, &client->heartbeat_timer);
+	timerCancel(&srv->wheel, &client->flush_timer);
+	if (client->peer_counted)
+		peerRelease(&client->peer);
+	client->peer_counted = false;
+	if (srv->backend == BACKEND_EPOLL)
+		epoll_ctl(srv->epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+	if (srv->backend == BACKEND_URING && client->pending_ops > 0)
+	{
+		client->closing = true;
+		shutdown(client->fd, SHUT_RDWR);
+		struct io_uring_sqe *sqe = uringSqe(srv, NULL, UOP_NONE);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = client->fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	}
+	else
+		freeClient(srv, client);
+	// Remove the client from the arrays by replacing it with the last one
+	srv->fds_count--;
+	if (fd_i != srv->fds_count)
+	{
+		srv->fds[fd_i] = srv->fds[srv->fds_count];
+		srv->clients[fd_i] = srv->clients[srv->fds_count];
+		srv->clients[fd_i]->slot = fd_i;
+	}
+}
+
+/**
+ * @brief Start the flush deadline of a client whose socket stopped taking
+ * its messages, unless it is already running.
+ */
+void armFlushDeadline(t_server *srv, t_client *client)
+{
+	if (flush_deadline_ticks > 0 && client->flush_timer.pprev == NULL)
+		timerArm(&srv->wheel, &client->flush_timer, srv->tick + flush_deadline_ticks);
+}
+
+/**
+ * @brief Send as many queued messages as the socket accepts.
+ *
+ * Up to FLUSH_BATCH messages go out per writev(), header and payload as
+ * separate iovecs, without copying either.
+ * @return 0 on success (possibly with data left), -1 if the socket failed
+ */
+int flushClient(t_server *srv, t_client *client)
+{
+	struct iovec iov[FLUSH_BATCH * 2];
+
+	while (client->queue_count > 0)
+	{
+		int iovcnt = queueIov(client, iov);
+
+		metricAdd(&srv->metrics.syscalls, 1);
+		ssize_t sent = writev(client->fd, iov, iovcnt);
+		if (sent == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			perror("ChatServer: flushClient: writev()");
+			// The reader side will notice the broken connection and remove it
+			dropQueue(srv, client);
+			updateInterest(srv, client);
+			return (-1);
+		}
+		consumeQueue(srv, client, sent);
+	}
+	if (client->queue_count > 0)
+		armFlushDeadline(srv, client);
+	updateInterest(srv, client);
+	return (0);
+}
+
+/**
+ * @brief io_uring: queue a sendmsg SQE for a client's pending messages.
+ *
+ * Only one send per client is in flight so messages keep their order; the
+ * SQE goes out with the next io_uring_enter(), batched with every other
+ * recipient of the same broadcast.
+ */
+void uringFlush(t_server *srv, t_client *client)
+{
+	if (client->sending || client->closing || client->queue_count == 0)
+		return;
+	if (client->send_iov == NULL &&
+		(client->send_iov = malloc(FLUSH_BATCH * 2 * sizeof(struct iovec))) == NULL)
+	{
+		perror("ChatServer: uringFlush: malloc()");
+		return;
+	}
+	client->send_msg = (struct msghdr){0};
+	client->send_msg.msg_iov = client->send_iov;
+	client->send_msg.msg_iovlen = queueIov(client, client->send_iov);
+
+	struct io_uring_sqe *sqe = uringSqe(srv, client, UOP_SEND);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = client->fd;
+	sqe->addr = (unsigned long)&client->send_msg;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	client->sending = true;
+	armFlushDeadline(srv, client);
+}
+
+/**
+ * @brief Make room for one more message in a client's ring.
+ * @return 0 on success, -1 if the ring is at OUTQ_MAX or allocation failed
+ */
+int growQueue(t_client *client)
+{
+	if (client->queue_count < client->queue_capacity)
+		return (0);
+	if (client->queue_capacity >= OUTQ_MAX)
+		return (-1);
+
+	int capacity = client->queue_capacity ? client->queue_capacity * 2 : OUTQ_MIN;
+	t_message **grown = malloc(capacity * sizeof(t_message *));
+	if (grown == NULL)
+		return (-1);
+	// Unwrap the ring so the oldest message is at index 0
+	for (int q = 0; q < client->queue_count; q++)
+		grown[q] = client->queue[(client->queue_head + q) % client->queue_capacity];
+	free(client->queue);
+	client->queue = grown;
+	client->queue_head = 0;
+	client->queue_capacity = capacity;
+	return (0);
+}
+
+/**
+ * @brief Whether queueing `len` more bytes would put a client, or its shard,
+ * over the outbound limits.
+ */
+bool overLimit(t_server *srv, t_client *client, size_t len)
+{
+	return (client->queue_bytes + len > client_outq_bytes ||
+			metricGet(&srv->metrics.outbound_bytes) + len > shard_outq_bytes);
+}
+
+/**
+ * @brief Whether a client's socket is full: the peer really is not keeping up.
+ */
+bool socketBacklogged(t_client *client)
+{
+	struct pollfd pfd = {.fd = client->fd, .events = POLLOUT};
+
+	return (poll(&pfd, 1, 0) == 0);
+}
+
+/**
+ * @brief Drop the oldest message of a client's queue that is safe to drop.
+ *
+ * A partially sent head message must be finished, or the stream would be
+ * corrupted, and with io_uring the messages of an in-flight sendmsg are
+ * still being read by the kernel: those are kept, and the entries in front
+ * of the victim are shifted up one slot.
+ * @return 0 if a message was dropped, -1 if none can be
+ */
+int dropOldest(t_server *srv, t_client *client)
+{
+	int keep = 0;
+
+	if (client->sending)
+		keep = client->queue_count < FLUSH_BATCH ? client->queue_count : FLUSH_BATCH;
+	else if (client->queue_sent > 0)
+		keep = 1;
+	if (keep >= client->queue_count)
+		return (-1);
+
+	int cap = client->queue_capacity;
+	t_message *victim = client->queue[(client->queue_head + keep) % cap];
+	for (int i = keep; i > 0; i--)
+		client->queue[(client->queue_head + i) % cap] = client->queue[(client->queue_head + i - 1) % cap];
+	client->queue_head = (client->queue_head + 1) % cap;
+	client->queue_count--;
+	queueBytes(srv, client, -(long)(victim->header_len + victim->len));
+	metricAdd(&srv->metrics.dequeued, 1);
+	metricAdd(&srv->metrics.slow_dropped, 1);
+	releaseMessage(victim);
+	return (0);
+}
+
+/**
+ * @brief Apply the slow-consumer policy before queueing `len` bytes of `msg`.
+ * @return true if the message may be queued
+ */
+bool admitQueued(t_server *srv, t_client *client, t_message *msg, size_t len)
+{
+	if (!overLimit(srv, client, len))
+		return (true);
+	// Messages wait in the queue until the end of the loop iteration, so a
+	// burst alone can fill the queue of a client that reads fine: write out
+	// what is pending first and only count what the socket does not take.
+	// io_uring has no synchronous write, there the client only counts as
+	// slow once its socket is backed up. The shard limit still holds.
+	if (srv->backend != BACKEND_URING)
+	{
+		if (client->dirty && flushClient(srv, client) == 0 && !overLimit(srv, client, len))
+			return (true);
+	}
+	else if (metricGet(&srv->metrics.outbound_bytes) + len <= shard_outq_bytes &&
+			 !socketBacklogged(client))
+		return (true);
+
+	if (slow_policy == SLOW_DROP_OLDEST)
+	{
+		while (overLimit(srv, client, len))
+		{
+			if (dropOldest(srv, client) == -1)
+			{
+				// Nothing left to drop: the new message goes instead
+				metricAdd(&srv->metrics.slow_skipped, 1);
+				return (false);
+			}
+		}
+		return (true);
+	}
+	if (slow_policy == SLOW_SKIP)
+	{
+		if (msg->critical)
+			return (true);
+		metricAdd(&srv->metrics.slow_skipped, 1);
+		return (false);
+	}
+
+	// SLOW_DISCONNECT: the owning shard sees EOF and removes the client
+	metricAdd(&srv->metrics.slow_evicted, 1);
+	logLine("ChatServer: fd %d is too slow (%zu bytes queued), disconnecting", client->fd,
+			client->queue_bytes);
+	client->evicted = true;
+	if (!client->sending)
+		dropQueue(srv, client);
+	shutdown(client->fd, SHUT_RDWR);
+	return (false);
+}
+
+/**
+ * @brief Schedule a client for the flush at the end of this loop iteration.
+ *
+ * If the list cannot grow the client is flushed right away instead.
+ */
+void markDirty(t_server *srv, t_client *client)
+{
+	if (client->dirty)
+		return;
+	if (srv->dirty_count == srv->dirty_capacity)
+	{
+		int capacity = srv->dirty_capacity ? srv->dirty_capacity * 2 : DIRTY_MIN;
+		t_client **grown = realloc(srv->dirty, capacity * sizeof(t_client *));
+		if (grown == NULL)
+		{
+			if (srv->backend == BACKEND_URING)
+				uringFlush(srv, client);
+			else
+				flushClient(srv, client);
+			return;
+		}
+		srv->dirty = grown;
+		srv->dirty_capacity = capacity;
+	}
+	if (srv->dirty_count == 0)
+		srv->dirty_since = nowNs();
+	srv->dirty[srv->dirty_count++] = client;
+	client->dirty = true;
+}
+
+/**
+ * @brief Write out what was queued for every dirty client, one vectored
+ * write (or sendmsg) per client however many messages it got.
+ *
+ * Sessions freed since they were listed have `dirty` cleared and are
+ * skipped; one reused meanwhile may be listed twice, and flushed once.
+ */
+void flushDirty(t_server *srv)
+{
+	for (int d = 0; d < srv->dirty_count; d++)
+	{
+		t_client *client = srv->dirty[d];
+		if (!client->dirty)
+			continue;
+		client->dirty = false;
+		metricAdd(&srv->metrics.flushes, 1);
+		if (srv->backend == BACKEND_URING)
+			uringFlush(srv, client);
+		else
+			flushClient(srv, client);
+	}
+	srv->dirty_count = 0;
+}
+
+/**
+ * @brief Queue a message for one client without ever blocking or copying it.
+ *
+ * The client's ring takes a reference and the client is marked dirty: all
+ * the messages it gets during one loop iteration (or batching window, see
+ * -w) then go out in a single writev() or sendmsg(). A client already
+ * waiting for its socket to drain (POLLOUT, or an io_uring send in flight)
+ * is not marked, the pending write picks the message up. Queueing is
+ * subject to the slow-consumer limits, see admitQueued().
+ */
+void queueSend(t_server *srv, t_client *client, t_message *msg)
+{
+	bool idle = srv->backend == BACKEND_URING ? !client->sending : client->queue_count == 0;
+
+	if (client->evicted)
+		return;
+	if (!admitQueued(srv, client, msg, msg->header_len + msg->len))
+		return;
+	if (growQueue(client) == -1)
+	{
+		metricAdd(&srv->metrics.queue_full, 1);
+		logLine("ChatServer: fd %d is not reading, dropping a message", client->fd);
+		return;
+	}
+	client->queue[(client->queue_head + client->queue_count) % client->queue_capacity] = retainMessage(msg);
+	client->queue_count++;
+	metricAdd(&srv->metrics.queued, 1);
+	queueBytes(srv, client, msg->header_len + msg->len);
+	if (idle)
+		markDirty(srv, client);
+}
+
+/**
+ * @brief Send a client the last messages of the room it just joined.
+ *
+ * The history's own messages are queued: each recipient only takes a
+ * reference and the frames are written straight from the mapped segments.
+ */
+void historyReplay(t_server *srv, t_client *client)
+{
+	t_message *replay[HISTORY_RING];
+	int n = 0;
+
+	if (history_dir == NULL)
+		return;
+	pthread_mutex_lock(&history_lock);
+	for (int i = history_count - 1; i >= 0 && n < history_replay; i--)
+	{
+		t_message *msg = history_ring[(history_head + i) % HISTORY_RING];
+		if (!msg->to_room || strcmp(msg->room, client->room->name) == 0)
+			replay[n++] = retainMessage(msg);
+	}
+	pthread_mutex_unlock(&history_lock);
+
+	// Collected newest first, sent oldest first
+	while (n-- > 0)
+	{
+		queueSend(srv, client, replay[n]);
+		releaseMessage(replay[n]);
+	}
+}
+
+/**
+ * @brief Set up a session for a freshly accepted, non-blocking socket.
+ *
+ * Connections beyond the fd table, the shard's capacity or the -c limit
+ * of their source address are closed right away.
+ */
+void registerClient(t_server *srv, int newFd, const struct sockaddr *addr)
+{
+	char clientIP[INET6_ADDRSTRLEN];
+	struct in6_addr key;
+
+	if (!inet_ntop2(addr, clientIP, sizeof(clientIP)))
+		strcpy(clientIP, "?");
+	if (newFd >= sessions_max || srv->fds_count >= srv->fds_capacity)
+	{
+		metricAdd(&srv->metrics.rejected_full, 1);
+		logLine("ChatServer: too many clients, rejecting fd %d", newFd);
+		close(newFd);
+		return;
+	}
+	peerKey(addr, &key);
+	if (conns_per_ip > 0 && !peerAcquire(&key))
+	{
+		metricAdd(&srv->metrics.rejected_ip, 1);
+		logLine("ChatServer: %s already has %d connections, rejecting fd %d", clientIP, conns_per_ip, newFd);
+		close(newFd);
+		return;
+	}
+	t_client *client = allocSession(srv);
+	if (client == NULL)
+	{
+		perror("ChatServer: registerClient: calloc()");
+		if (conns_per_ip > 0)
+			peerRelease(&key);
+		close(newFd);
+		return;
+	}
+	// Writes are already coalesced per loop iteration (and by -w), so
+	// Nagle would only hold small messages back for a delayed ACK
+	int one = 1;
+	setsockopt(newFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	client->peer = key;
+	client->peer_counted = conns_per_ip > 0;
+	client->kind = CONN_CLIENT;
+	client->fd = newFd;
+	addFd(srv, client);
+	sessions[newFd] = client;
+	metricAdd(&srv->metrics.accepts, 1);
+
+	client->last_rx = client->last_tx = srv->tick;
+	client->idle_timer.kind = TIMER_IDLE;
+	client->heartbeat_timer.kind = TIMER_HEARTBEAT;
+	client->flush_timer.kind = TIMER_FLUSH;
+	if (idle_ticks > 0)
+		timerArm(&srv->wheel, &client->idle_timer, srv->tick + idle_ticks);
+	if (heartbeat_ticks > 0)
+		timerArm(&srv->wheel, &client->heartbeat_timer, srv->tick + heartbeat_ticks);
+
+	if (joinRoom(srv, client, "") == -1)
+	{
+		perror("ChatServer: registerClient: joinRoom()");
+		removeConnection(srv, client);
+		return;
+	}
+
+	// Edge-triggered: handleClientMessage drains the socket on every event
+	if (watchFd(srv, client, EPOLLIN | EPOLLRDHUP | EPOLLET) == -1)
+	{
+		perror("ChatServer: registerClient: epoll_ctl()");
+		removeConnection(srv, client);
+		return;
+	}
+
+	if (shards_count > 1)
+		logLine("ChatServer: new connection from %s (fd %d, shard %d)", clientIP, newFd, srv->id);
+	else
+		logLine("ChatServer: new connection from %s (fd %d)", clientIP, newFd);
+	historyReplay(srv, client);
+}
+
+/**
+ * @brief Drop the connection at the head of the backlog when the process
+ * is out of file descriptors.
+ *
+ * Left there it would be reported again on every wakeup (or, edge-triggered,
+ * never again): the reserve fd is closed to make room for accepting it,
+ * the connection is closed and the reserve taken back.
+ * @return true if a connection was shed
+ */
+bool shedConnection(t_server *srv)
+{
+	if (srv->reserveFd == -1)
+		return (false);
+	close(srv->reserveFd);
+	int fd = accept(srv->serverFd, NULL, NULL);
+	if (fd != -1)
+		close(fd);
+	srv->reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (false);
+	metricAdd(&srv->metrics.rejected_full, 1);
+	logLine("ChatServer: out of file descriptors, rejecting a connection");
+	return (true);
+}
+
+/**
+ * @brief Accept every connection pending on the listening socket.
+ *
+ * A reconnect storm fills the backlog faster than one accept per wakeup
+ * could empty it, so the backlog is drained until EAGAIN. accept4() hands
+ * out non-blocking, close-on-exec sockets without two more fcntl() calls.
+ */
+void acceptConnections(t_server *srv)
+{
+	while (true)
+	{
+		struct sockaddr_storage clientAddr;
+		socklen_t addrLen = sizeof(clientAddr);
+		metricAdd(&srv->metrics.syscalls, 1);
+		int newFd = accept4(srv->serverFd, (struct sockaddr *)&clientAddr, &addrLen,
+							SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (newFd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if ((errno == EMFILE || errno == ENFILE) && shedConnection(srv))
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("ChatServer: acceptConnections: accept4()");
+			return;
+		}
+		registerClient(srv, newFd, (struct sockaddr *)&clientAddr);
+	}
+}
+
+/**
+ * @brief Send a message to every client of this shard except `except`.
+ *
+ * Each recipient gets a pointer to the same message, never a copy.
+ */
+void broadcast(t_server *srv, t_client *except, t_message *msg)
+{
+	for (int i = 0; i < srv->fds_count; i++)
+	{
+		t_client *client = srv->clients[i];
+		if (client->kind == CONN_CLIENT && client != except)
+			queueSend(srv, client, msg);
+	}
+}
+
+/**
+ * @brief Send a message to the members of a room on this shard, except `except`.
+ *
+ * Costs O(room members), whatever the number of connected clients.
+ */
+void broadcastRoom(t_server *srv, t_room *room, t_client *except, t_message *msg)
+{
+	for (int i = 0; i < room->members_count; i++)
+	{
+		if (room->members[i] != except)
+			queueSend(srv, room->members[i], msg);
+	}
+}
+
+/**
+ * @brief Hand a message to every other shard and wake them up.
+ *
+ * Each shard fans the message out to its own clients on its own thread, so
+ * the per-recipient send cost is spread over all cores. Shards only get a
+ * reference, the message itself is never copied.
+ * @param srv The sending shard, NULL from the relay thread (every shard gets it)
+ */
+void broadcastShards(t_server *srv, t_message *msg)
+{
+	for (int s = 0; s < shards_count; s++)
+	{
+		t_server *dst = &shards[s];
+		if (dst == srv)
+			continue;
+
+		pthread_mutex_lock(&dst->inboxLock);
+		if (dst->inbox_count == dst->inbox_capacity)
+		{
+			int capacity = dst->inbox_capacity ? dst->inbox_capacity * 2 : OUTQ_MIN;
+			t_message **grown = realloc(dst->inbox, capacity * sizeof(t_message *));
+			if (grown == NULL)
+			{
+				pthread_mutex_unlock(&dst->inboxLock);
+				perror("ChatServer: broadcastShards: realloc()");
+				continue;
+			}
+			dst->inbox = grown;
+			dst->inbox_capacity = capacity;
+		}
+		dst->inbox[dst->inbox_count++] = retainMessage(msg);
+		bool wasEmpty = (dst->inbox_count == 1);
+		pthread_mutex_unlock(&dst->inboxLock);
+
+		// A non-empty inbox already has a wakeup in flight
+		if (wasEmpty)
+		{
+			if (srv != NULL)
+				metricAdd(&srv->metrics.syscalls, 1);
+			if (eventfd_write(dst->wakeFd, 1) == -1)
+				perror("ChatServer: broadcastShards: eventfd_write()");
+		}
+	}
+}
+
+/**
+ * @brief Hand a message of a local client to the relay thread, for the other nodes.
+ *
+ * Same hand-over as between shards: the relay thread encodes it once and
+ * queues it on every relay link.
+ */
+void relayPublish(t_server *srv, t_message *msg)
+{
+	if (relay_wake_fd == -1)
+		return;
+
+	pthread_mutex_lock(&relay_lock);
+	if (relay_inbox_count == relay_inbox_capacity)
+	{
+		int capacity = relay_inbox_capacity ? relay_inbox_capacity * 2 : OUTQ_MIN;
+		t_message **grown = realloc(relay_inbox, capacity * sizeof(t_message *));
+		if (grown == NULL)
+		{
+			pthread_mutex_unlock(&relay_lock);
+			perror("ChatServer: relayPublish: realloc()");
+			return;
+		}
+		relay_inbox = grown;
+		relay_inbox_capacity = capacity;
+	}
+	relay_inbox[relay_inbox_count++] = retainMessage(msg);
+	bool wasEmpty = (relay_inbox_count == 1);
+	pthread_mutex_unlock(&relay_lock);
+
+	if (wasEmpty)
+	{
+		metricAdd(&srv->metrics.syscalls, 1);
+		if (eventfd_write(relay_wake_fd, 1) == -1)
+			perror("ChatServer: relayPublish: eventfd_write()");
+	}
+}
+
+/**
+ * @brief Deliver every message other shards queued for this shard's clients.
+ */
+void drainInbox(t_server *srv)
+{
+	eventfd_t wakeups;
+
+	// Reset the counter first so a message queued after the swap re-arms it
+	metricAdd(&srv->metrics.syscalls, 1);
+	eventfd_read(srv->wakeFd, &wakeups);
+
+	pthread_mutex_lock(&srv->inboxLock);
+	t_message **batch = srv->inbox;
+	int count = srv->inbox_count;
+	int capacity = srv->inbox_capacity;
+	srv->inbox = srv->spare;
+	srv->inbox_capacity = srv->spare_capacity;
+	srv->inbox_count = 0;
+	pthread_mutex_unlock(&srv->inboxLock);
+	srv->spare = batch;
+	srv->spare_capacity = capacity;
+
+	for (int m = 0; m < count; m++)
+	{
+		if (!batch[m]->to_room)
+			broadcast(srv, NULL, batch[m]);
+		else
+		{
+			t_room *room = findRoom(srv, batch[m]->room);
+			if (room != NULL)
+				broadcastRoom(srv, room, NULL, batch[m]);
+		}
+		observeFanout(&srv->metrics, batch[m]->born_ns);
+		releaseMessage(batch[m]);
+	}
+}
+
+/**
+ * @brief Handle server input character by character
+ */
+void handleServerInput(t_server *srv)
+{
+	char c;
+	ssize_t n = read(STDIN_FILENO, &c, 1);
+
+	pthread_mutex_lock(&tty_lock);
+
+	if (n <= 0)
+	{
+		printf("\nChatServer: shutting down...\n");
+		disable_raw_mode();
+		exit(EXIT_SUCCESS);
+	}
+
+	// Handle Ctrl+D (EOF - ASCII 4) - using portable helper
+	if (c == 4)
+	{
+		printf("\nChatServer: shutting down...\n");
+		disable_raw_mode();
+		exit(EXIT_SUCCESS);
+	}
+
+	if (c == '\n' || c == '\r')
+	{
+		// Send the message
+		if (input_pos > 0)
+		{
+			// Check for server commands (need full word match)
+			current_input[input_pos] = '\0'; // Temporarily null-terminate for comparison
+			if ((strcmp(current_input, "exit") == 0) || (strcmp(current_input, "quit") == 0))
+			{
+				printf("\nChatServer: shutting down...\n");
+				disable_raw_mode();
+				exit(EXIT_SUCCESS);
+			}
+
+			// clear the chat (for the server and clients)
+			if (strcmp(current_input, "clear") == 0)
+			{
+				t_message *msg = newMessage(FRAME_CLEAR, "", "", 0);
+				if (msg != NULL)
+				{
+					msg->critical = true;
+					broadcast(srv, NULL, msg);
+					broadcastShards(srv, msg);
+					releaseMessage(msg);
+				}
+				printf("\033c"); // Clear terminal
+				input_pos = 0;
+				memset(current_input, 0, sizeof(current_input));
+				printf("Server: ");
+				fflush(stdout);
+				pthread_mutex_unlock(&tty_lock);
+				return;
+			}
+
+			// disconnect one client: "kick <fd>"
+			int kickFd;
+			if (sscanf(current_input, "kick %d", &kickFd) == 1)
+			{
+				// The owning shard sees EOF and removes the session itself
+				if (findSession(kickFd) != NULL)
+					shutdown(kickFd, SHUT_RDWR);
+				else
+					printf("\nChatServer: no client with fd %d", kickFd);
+				input_pos = 0;
+				memset(current_input, 0, sizeof(current_input));
+				printf("\nServer: ");
+				fflush(stdout);
+				pthread_mutex_unlock(&tty_lock);
+				return;
+			}
+
+			// Send message to all clients
+			t_message *msg = newMessage(FRAME_CHAT, "Server: ", current_input, input_pos);
+			if (msg != NULL)
+			{
+				msg->critical = true;
+				broadcast(srv, NULL, msg);
+				broadcastShards(srv, msg);
+				historyAppend(msg);
+				releaseMessage(msg);
+			}
+
+			// Clear input buffer
+			input_pos = 0;
+			memset(current_input, 0, sizeof(current_input));
+		}
+		printf("\nServer: ");
+		fflush(stdout);
+	}
+	else if (c == 127 || c == '\b') // Backspace
+	{
+		if (input_pos > 0)
+		{
+			input_pos--;
+			current_input[input_pos] = '\0';
+			redraw_input_line();
+			printf(" \b"); // Clear the deleted character
+			fflush(stdout);
+		}
+	}
+	else if (c >= 32 && c <= 126 && input_pos < BUFFER_SIZE - 2) // Printable characters
+	{
+		current_input[input_pos++] = c;
+		printf("%c", c);
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&tty_lock);
+}
+
+/**
+ * @brief Send a notice from the server to one client.
+ */
+void notifyClient(t_server *srv, t_client *client, const char *text)
+{
+	t_message *msg = newMessage(FRAME_CHAT, "ChatServer: ", text, strlen(text));
+
+	if (msg == NULL)
+		return;
+	msg->critical = true;
+	queueSend(srv, client, msg);
+	releaseMessage(msg);
+}
+
+/**
+ * @brief Handle a join/leave request: move the client to room `name`.
+ *
+ * Names must be printable and at most ROOM_NAME_MAX bytes; "" is the lobby.
+ */
+void changeRoom(t_server *srv, t_client *client, const char *name, size_t len)
+{
+	char room[ROOM_NAME_MAX + 1];
+	char notice[ROOM_NAME_MAX + 32];
+
+	if (len > ROOM_NAME_MAX)
+	{
+		notifyClient(srv, client, "room name too long");
+		return;
+	}
+	for (size_t i = 0; i < len; i++)
+	{
+		if (name[i] < 32 || name[i] > 126)
+		{
+			notifyClient(srv, client, "invalid room name");
+			return;
+		}
+	}
+	memcpy(room, name, len);
+	room[len] = '\0';
+
+	if (joinRoom(srv, client, room) == -1)
+	{
+		perror("ChatServer: changeRoom: joinRoom()");
+		notifyClient(srv, client, "could not join room");
+		return;
+	}
+	if (room[0] != '\0')
+		snprintf(notice, sizeof(notice), "joined room %s", room);
+	else
+		snprintf(notice, sizeof(notice), "back in the lobby");
+	notifyClient(srv, client, notice);
+	historyReplay(srv, client);
+}
+
+/**
+ * @brief Act on one complete frame received from a client.
+ */
+void handleFrame(t_server *srv, t_client *client, uint8_t type, const char *data, size_t len)
+{
+	if (type == FRAME_JOIN || type == FRAME_LEAVE)
+	{
+		changeRoom(srv, client, type == FRAME_JOIN ? data : "", type == FRAME_JOIN ? len : 0);
+		return;
+	}
+	// Receiving it was the point: it moved last_rx
+	if (type == FRAME_PONG)
+		return;
+	if (type != FRAME_CHAT)
+	{
+		logLine("ChatServer: fd %d sent unknown frame type %d", client->fd, type);
+		return;
+	}
+
+	metricAdd(&srv->metrics.frames_in, 1);
+
+	// Format the header once, every recipient shares the same message
+	char prefix[HEADER_SIZE];
+	snprintf(prefix, sizeof(prefix), "Client %d: ", client->fd);
+	t_message *msg = newMessage(FRAME_CHAT, prefix, data, len);
+	if (msg == NULL)
+		return;
+	msg->to_room = true;
+	memcpy(msg->room, client->room->name, sizeof(msg->room));
+	// Headless servers do not echo chat text, it would cost a write per message
+	if (!headless && msg->room[0] != '\0')
+		logLine("[%s] %s%.*s", msg->room, prefix, (int)msg->len, msg->data);
+	else if (!headless)
+		logLine("%s%.*s", prefix, (int)msg->len, msg->data);
+	// Send to the other members of the sender's room, here and on other shards
+	broadcastRoom(srv, client->room, client, msg);
+	broadcastShards(srv, msg);
+	relayPublish(srv, msg);
+	observeFanout(&srv->metrics, msg->born_ns);
+	historyAppend(msg);
+	releaseMessage(msg);
+}
+
+/**
+ * @brief Split received bytes into frames.
+ *
+ * Frames that arrived whole are handled straight from `data`; only a frame
+ * cut by the end of a read is copied into the client's reassembly buffer.
+ * @return 0 on success, -1 on a protocol error (oversized frame)
+ */
+int feedFrames(t_server *srv, t_client *client, const char *data, size_t n)
+{
+	while (n > 0)
+	{
+		// Fast path: a whole frame is available in the read buffer
+		if (client->in_len == 0 && n >= FRAME_HEADER_SIZE)
+		{
+			uint32_t len = frameLength((const unsigned char *)data);
+			if (len > FRAME_MAX)
+				return (-1);
+			if (n >= FRAME_HEADER_SIZE + len)
+			{
+				handleFrame(srv, client, data[4], data + FRAME_HEADER_SIZE, len);
+				data += FRAME_HEADER_SIZE + len;
+				n -= FRAME_HEADER_SIZE + len;
+				continue;
+			}
+		}
+
+		// Slow path: accumulate the header, then the rest of the frame
+		size_t want = FRAME_HEADER_SIZE;
+		if (client->in_len >= FRAME_HEADER_SIZE)
+			want += frameLength((unsigned char *)client->in);
+		else if (client->in_len + n >= FRAME_HEADER_SIZE)
+		{
+			// Peek at the length across the buffered and the new bytes
+			unsigned char hdr[FRAME_HEADER_SIZE];
+			memcpy(hdr, client->in, client->in_len);
+			memcpy(hdr + client->in_len, data, FRAME_HEADER_SIZE - client->in_len);
+			if (frameLength(hdr) > FRAME_MAX)
+				return (-1);
+			want += frameLength(hdr);
+		}
+		if (client->in_capacity < want)
+		{
+			size_t capacity = want < RECV_SIZE ? RECV_SIZE : want;
+			char *grown = realloc(client->in, capacity);
+			if (grown == NULL)
+			{
+				perror("ChatServer: feedFrames: realloc()");
+				return (-1);
+			}
+			client->in = grown;
+			client->in_capacity = capacity;
+		}
+
+		size_t take = want - client->in_len;
+		if (take > n)
+			take = n;
+		memcpy(client->in + client->in_len, data, take);
+		client->in_len += take;
+		data += take;
+		n -= take;
+
+		if (client->in_len >= FRAME_HEADER_SIZE && client->in_len == want)
+		{
+			handleFrame(srv, client, client->in[4], client->in + FRAME_HEADER_SIZE,
+						want - FRAME_HEADER_SIZE);
+			client->in_len = 0;
+			// Big frames are rare, do not keep their buffer around
+			if (client->in_capacity > RECV_SIZE)
+			{
+				free(client->in);
+				client->in = NULL;
+				client->in_capacity = 0;
+			}
+		}
+	}
+	return (0);
+}
+
+/**
+ * @brief Process the outcome of one read from a client.
+ * @param bytesRead Result of the read; on -1, errno holds the error
+ * @return 1 if data was handled, 0 if the socket has no more data,
+ *         -1 if the client disconnected (caller must remove it)
+ */
+int clientReceived(t_server *srv, t_client *client, const char *data, ssize_t bytesRead)
+{
+	int clientFd = client->fd;
+
+	if (bytesRead <= 0)
+	{
+		if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return (0);
+		if (bytesRead == 0)
+			logLine("ChatServer: client with fd %d disconnected", clientFd);
+		else
+			logLine("ChatServer: handleClientMessage: recv(): %s", strerror(errno));
+		return (-1);
+	}
+
+	metricAdd(&srv->metrics.bytes_in, bytesRead);
+	client->last_rx = srv->tick;
+	if (feedFrames(srv, client, data, bytesRead) == -1)
+	{
+		logLine("ChatServer: client with fd %d sent an invalid frame, disconnecting", clientFd);
+		return (-1);
+	}
+	return (1);
+}
+
+/**
+ * @brief Read what a client sent and relay every complete frame.
+ *
+ * The recv() never blocks so the epoll backend can call this in a loop until
+ * the socket is drained.
+ * @return 1 if data was read, 0 if the socket has no more data,
+ *         -1 if the client disconnected (caller must remove it)
+ */
+int handleClientMessage(t_server *srv, t_client *client)
+{
+	char buffer[RECV_SIZE];
+
+	metricAdd(&srv->metrics.syscalls, 1);
+	return (clientReceived(srv, client, buffer, recv(client->fd, buffer, sizeof(buffer), 0)));
+}
+
+/**
+ * @brief poll() backend: scan the fds array for ready descriptors.
+ */
+void polling(t_server *srv, int polls)
+{
 	int polled = 0;
 
-	for (int i = 0; i < *fds_count && polled < polls; i++)
+	for (int i = 0; i < srv->fds_count && polled < polls; i++)
+	{
+		short revents = srv->fds[i].revents;
+		t_client *conn = srv->clients[i];
+
+		if (revents == 0)
+			continue;
+		polled++;
+		if (conn->kind == CONN_LISTENER)
+			acceptConnections(srv);
+		else if (conn->kind == CONN_WAKEUP)
+			drainInbox(srv);
+		else if (conn->kind == CONN_STDIN)
+			handleServerInput(srv);
+		else
+		{
+			if (revents & POLLOUT)
+				flushClient(srv, conn);
+			if ((revents & (POLLIN | POLLHUP | POLLERR)) &&
+				handleClientMessage(srv, conn) == -1)
+			{
+				removeConnection(srv, conn);
+				// Re-check this position (which now has a different client)
+				i--;
+			}
+		}
+	}
+}
+
+/**
+ * @brief epoll backend: only the ready descriptors are visited.
+ *
+ * Sockets are edge-triggered, so each event drains its fd until EAGAIN.
+ */
+void epolling(t_server *srv, struct epoll_event *events, int polls)
+{
+	for (int e = 0; e < polls; e++)
+	{
+		t_client *conn = events[e].data.ptr;
+
+		if (conn->kind == CONN_LISTENER)
+			acceptConnections(srv);
+		else if (conn->kind == CONN_WAKEUP)
+			drainInbox(srv);
+		else if (conn->kind == CONN_STDIN)
+			handleServerInput(srv);
+		else
+		{
+			int rc = 0;
+			if (events[e].events & EPOLLOUT)
+				flushClient(srv, conn);
+			if (events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			{
+				while ((rc = handleClientMessage(srv, conn)) == 1)
+					;
+			}
+			if (rc == -1)
+				removeConnection(srv, conn);
+		}
+	}
+}
+
+/**
+ * @brief io_uring backend: handle every completion posted since the last wait.
+ *
+ * Multishot requests keep producing completions until one comes without
+ * IORING_CQE_F_MORE; the request is then re-armed (or, for a closing
+ * client, retired).
+ */
+void uringing(t_server *srv)
+{
+	t_uring *ring = &srv->uring;
+	unsigned head = *ring->cq_head;
+	unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire);
+
+	for (; head != tail; head++)
+	{
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		t_uring_op op = cqe->user_data & UOP_MASK;
+		t_client *conn = (t_client *)(unsigned long)(cqe->user_data & ~UOP_MASK);
+		bool more = cqe->flags & IORING_CQE_F_MORE;
+
+		if (op == UOP_NONE)
+			continue;
+		if (!more)
+			conn->pending_ops--;
+
+		if (op == UOP_RECV)
+		{
+			int rc = 0;
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+			{
+				unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				if (!conn->closing)
+					rc = clientReceived(srv, conn, ring->bufs + (size_t)bid * RECV_SIZE, cqe->res);
+				uringRecycle(ring, bid);
+			}
+			else if (!conn->closing && cqe->res != -ENOBUFS)
+			{
+				errno = -cqe->res;
+				rc = clientReceived(srv, conn, NULL, cqe->res < 0 ? -1 : 0);
+			}
+			if (rc == -1)
+			{
+				// May free the client right away, do not touch it afterwards
+				removeConnection(srv, conn);
+				continue;
+			}
+			// Out of buffers or kernel ended the multishot: ask again
+			if (!more && !conn->closing)
+				uringArm(srv, conn);
+		}
+		else if (op == UOP_SEND)
+		{
+			conn->sending = false;
+			if (cqe->res >= 0)
+				consumeQueue(srv, conn, cqe->res);
+			else
+			{
+				if (!conn->closing && cqe->res != -ECANCELED)
+				{
+					errno = -cqe->res;
+					perror("ChatServer: uringing: sendmsg()");
+				}
+				dropQueue(srv, conn);
+			}
+			// Goes out with whatever else this batch queues for the client
+			if (conn->queue_count > 0)
+				markDirty(srv, conn);
+		}
+		else if (op == UOP_ACCEPT)
+		{
+			if (cqe->res >= 0)
+			{
+				struct sockaddr_storage clientAddr = {0};
+				socklen_t addrLen = sizeof(clientAddr);
+				getpeername(cqe->res, (struct sockaddr *)&clientAddr, &addrLen);
+				registerClient(srv, cqe->res, (struct sockaddr *)&clientAddr);
+			}
+			else if (cqe->res == -EMFILE || cqe->res == -ENFILE)
+				while (shedConnection(srv))
+					;
+			if (!more)
+				uringArm(srv, conn);
+		}
+		else if (conn->kind == CONN_WAKEUP)
+		{
+			drainInbox(srv);
+			if (!more)
+				uringArm(srv, conn);
+		}
+		else
+		{
+			// Poll completions are edge-like: consume all typed characters
+			struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+			do
+				handleServerInput(srv);
+			while (poll(&pfd, 1, 0) == 1);
+			if (!more)
+				uringArm(srv, conn);
+		}
+
+		if (conn->closing && conn->pending_ops == 0)
+			freeClient(srv, conn);
+	}
+	atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head, memory_order_release);
+}
+
+/**
+ * @brief Parse a backend name given to -b.
+ * @return 0 on success, -1 if the name is unknown
+ */
+int parse_backend(const char *name, t_backend *backend)
+{
+	if (strcmp(name, "poll") == 0)
+		*backend = BACKEND_POLL;
+	else if (strcmp(name, "epoll") == 0)
+		*backend = BACKEND_EPOLL;
+	else if (strcmp(name, "uring") == 0)
+		*backend = BACKEND_URING;
+	else
+		return (-1);
+	return (0);
+}
+
+/**
+ * @brief Parse a slow-consumer policy given to -P.
+ * @return 0 on success, -1 if the name is unknown
+ */
+int parse_policy(const char *name)
+{
+	if (strcmp(name, "drop-oldest") == 0)
+		slow_policy = SLOW_DROP_OLDEST;
+	else if (strcmp(name, "disconnect") == 0)
+		slow_policy = SLOW_DISCONNECT;
+	else if (strcmp(name, "skip") == 0)
+		slow_policy = SLOW_SKIP;
+	else
+		return (-1);
+	return (0);
+}
+
+/**
+ * @brief Add a -R peer, given as HOST:PORT ([ADDRESS]:PORT for IPv6).
+ * @return 0 on success, -1 if malformed or too many peers
+ */
+int parse_relay(char *arg)
+{
+	char *colon = strrchr(arg, ':');
+
+	if (relays_count == MAX_RELAYS || colon == NULL || colon == arg || colon[1] == '\0')
+		return (-1);
+	*colon = '\0';
+	if (arg[0] == '[' && colon[-1] == ']')
+	{
+		arg++;
+		colon[-1] = '\0';
+	}
+	relays[relays_count++] = (t_relay){.host = arg, .port = colon + 1, .link = -1};
+	return (0);
+}
+
+/**
+ * @brief Parse an address family given to -a.
+ * @return 0 on success, -1 if the name is unknown
+ */
+int parse_family(const char *name)
+{
+	listen_dual = false;
+	if (strcmp(name, "inet") == 0)
+		listen_family = AF_INET;
+	else if (strcmp(name, "inet6") == 0)
+		listen_family = AF_INET6;
+	else if (strcmp(name, "dual") == 0)
+	{
+		listen_family = AF_INET6;
+		listen_dual = true;
+	}
+	else
+		return (-1);
+	return (0);
+}
+
+/**
+ * @brief Create a non-blocking listening socket bound to `port`.
+ *
+ * With `shared`, SO_REUSEPORT lets every shard bind its own listener to
+ * the same port; the kernel then spreads incoming connections across them.
+ * Single listeners leave it off, so another process cannot bind the port
+ * and quietly take a share of the connections. The address family and
+ * backlog come from -a and -l.
+ * @return the listening fd, or -1 on failure
+ */
+int createListener(const char *port, bool shared)
+{
+	struct addrinfo hints, *serverAddr;
+
+	hints = (struct addrinfo){0};
+	hints.ai_family = listen_family;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	// Resolve local address
+	int rv;
+	if ((rv = getaddrinfo(NULL, port, &hints, &serverAddr)) != 0)
+	{
+		fprintf(stderr, "ChatServer: getaddrinfo(): %s\n",
+				gai_strerror(rv));
+		return (-1);
+	}
+
+	// Create and bind TCP socket
+	int serverFd, yes = 1;
+	struct addrinfo *p;
+	for (p = serverAddr; p != NULL; p = p->ai_next)
+	{
+		// Create socket
+		if ((serverFd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+		{
+			perror("ChatServer: createListener: socket()");
+			continue;
+		}
+
+		// Set socket options
+		// Dual-stack: IPv4 clients show up as ::ffff:a.b.c.d on the IPv6 socket
+		int v6only = !listen_dual;
+		if (setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+			(shared && setsockopt(serverFd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) ||
+			(p->ai_family == AF_INET6 &&
+			 setsockopt(serverFd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int)) == -1))
+		{
+			perror("ChatServer: createListener: setsockopt()");
+			close(serverFd);
+			continue;
+		}
+
+		// Bind socket
+		if (bind(serverFd, p->ai_addr, p->ai_addrlen) == -1)
+		{
+			perror("ChatServer: createListener: bind()");
+			close(serverFd);
+			continue;
+		}
+
+		break; // Successfully bound
+	}
+
+	freeaddrinfo(serverAddr);
+
+	if (p == NULL)
+	{
+		fprintf(stderr, "ChatServer: failed to bind\n");
+		return (-1);
+	}
+
+	// Listen for incoming connections
+	if (listen(serverFd, listen_backlog) == -1)
+	{
+		perror("ChatServer: createListener: listen()");
+		close(serverFd);
+		return (-1);
+	}
+
+	// The listener is drained until EAGAIN, so it must never block
+	if (set_nonblocking(serverFd) == -1)
+	{
+		perror("ChatServer: createListener: fcntl()");
+		close(serverFd);
+		return (-1);
+	}
+	return (serverFd);
+}
+
+/**
+ * @brief Set up a shard: listener, event backend, wakeup eventfd and fds array.
+ * @param ownsStdin true for the shard that reads the server operator's input
+ * @return 0 on success, -1 on failure
+ */
+int initShard(t_server *srv, int id, t_backend backend, const char *port, bool ownsStdin)
+{
+	srv->id = id;
+	srv->backend = backend;
+	srv->epollFd = -1;
+	srv->reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	srv->inbox = NULL;
+	srv->inbox_count = 0;
+	srv->inbox_capacity = 0;
+	srv->spare = NULL;
+	srv->spare_capacity = 0;
+	pthread_mutex_init(&srv->inboxLock, NULL);
+	srv->tick = srv->wheel.now = nowTick();
+	if ((srv->ping = newMessage(FRAME_PING, "", "", 0)) == NULL)
+		return (-1);
+	srv->ping->critical = true;
+
+	if ((srv->serverFd = createListener(port, true)) == -1)
+		return (-1);
+
+	if ((srv->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+	{
+		perror("ChatServer: initShard: eventfd()");
+		return (-1);
+	}
+
+	if (srv->backend == BACKEND_URING && uringSetup(&srv->uring) == -1)
+	{
+		perror("ChatServer: initShard: io_uring_setup()");
+		fprintf(stderr, "ChatServer: falling back to epoll backend\n");
+		srv->backend = BACKEND_EPOLL;
+	}
+	if (srv->backend == BACKEND_EPOLL && (srv->epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	{
+		perror("ChatServer: initShard: epoll_create1()");
+		fprintf(stderr, "ChatServer: falling back to poll backend\n");
+		srv->backend = BACKEND_POLL;
+	}
+
+	// Sized once for the whole fd range, pages are only touched when used
+	srv->fds_count = 0;
+	srv->fds_capacity = sessions_max;
+	srv->free_sessions = NULL;
+	srv->fds = malloc(srv->fds_capacity * sizeof(struct pollfd));
+	srv->clients = malloc(srv->fds_capacity * sizeof(t_client *));
+	srv->rooms_mask = ROOM_BUCKETS - 1;
+	srv->rooms_count = 0;
+	srv->rooms = calloc(ROOM_BUCKETS, sizeof(t_room *));
+	if (srv->fds == NULL || srv->clients == NULL || srv->rooms == NULL)
+	{
+		perror("ChatServer: initShard: malloc()");
+		return (-1);
+	}
+
+	// Add server socket, wakeup eventfd and standard input
+	srv->listener = (t_client){.kind = CONN_LISTENER, .fd = srv->serverFd};
+	srv->wakeup = (t_client){.kind = CONN_WAKEUP, .fd = srv->wakeFd};
+	srv->input = (t_client){.kind = CONN_STDIN, .fd = STDIN_FILENO};
+	addFd(srv, &srv->listener);
+	addFd(srv, &srv->wakeup);
+	if (ownsStdin)
+		addFd(srv, &srv->input);
+
+	// EPOLLEXCLUSIVE only matters if several epoll instances ever watch the
+	// listener: then just one of them is woken per incoming connection.
+	// stdin stays level-triggered, it is read one character per event.
+	if (watchFd(srv, &srv->listener, EPOLLIN | EPOLLET | EPOLLEXCLUSIVE) == -1 ||
+		watchFd(srv, &srv->wakeup, EPOLLIN | EPOLLET) == -1 ||
+		(ownsStdin && watchFd(srv, &srv->input, EPOLLIN) == -1))
+	{
+		perror("ChatServer: initShard: epoll_ctl()");
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * @brief Handle a client timer that expired.
+ *
+ * Reads and writes do not touch the wheel, they only record srv->tick: a
+ * timer whose client was active meanwhile is armed again for the time that
+ * is left. The wheel may lag srv->tick, hence no subtractions.
+ */
+void timerExpired(t_server *srv, t_timer *timer)
+{
+	uint64_t now = srv->wheel.now;
+	t_client *client;
+
+	if (timer->kind == TIMER_IDLE)
+	{
+		client = (t_client *)((char *)timer - offsetof(t_client, idle_timer));
+		if (client->last_rx + idle_ticks > now)
+		{
+			timerArm(&srv->wheel, timer, client->last_rx + idle_ticks);
+			return;
+		}
+		metricAdd(&srv->metrics.idle_timeouts, 1);
+		logLine("ChatServer: fd %d sent nothing for %lu s, disconnecting", client->fd,
+				idle_ticks * TIMER_TICK_MS / 1000);
+		removeConnection(srv, client);
+	}
+	else if (timer->kind == TIMER_HEARTBEAT)
+	{
+		client = (t_client *)((char *)timer - offsetof(t_client, heartbeat_timer));
+		if (client->last_rx + heartbeat_ticks > now)
+		{
+			timerArm(&srv->wheel, timer, client->last_rx + heartbeat_ticks);
+			return;
+		}
+		// The FRAME_PONG it answers with counts as activity for TIMER_IDLE
+		metricAdd(&srv->metrics.heartbeats, 1);
+		queueSend(srv, client, srv->ping);
+		timerArm(&srv->wheel, timer, now + heartbeat_ticks);
+	}
+	else
+	{
+		client = (t_client *)((char *)timer - offsetof(t_client, flush_timer));
+		if (client->queue_count == 0)
+			return;
+		if (client->last_tx + flush_deadline_ticks > now)
+		{
+			timerArm(&srv->wheel, timer, client->last_tx + flush_deadline_ticks);
+			return;
+		}
+		metricAdd(&srv->metrics.slow_deadline, 1);
+		logLine("ChatServer: fd %d took nothing for %lu s, disconnecting", client->fd,
+				flush_deadline_ticks * TIMER_TICK_MS / 1000);
+		removeConnection(srv, client);
+	}
+}
+
+/**
+ * @brief Advance the wheel to the current tick, running every timer that
+ * expired on the way.
+ */
+void runTimers(t_server *srv)
+{
+	t_wheel *wheel = &srv->wheel;
+	uint64_t target = nowTick();
+	t_timer *timer;
+
+	while (wheel->now < target)
+	{
+		// Nothing to cascade or run: jump straight to the current tick
+		if (wheel->armed == 0)
+		{
+			wheel->now = target;
+			break;
+		}
+		uint64_t tick = ++wheel->now;
+
+		// Entering a new round of level l - 1 spreads a level l slot below
+		for (int level = 1; level < WHEEL_LEVELS &&
+							(tick & ((1ULL << (WHEEL_BITS * level)) - 1)) == 0;
+			 level++)
+		{
+			t_timer **slot = &wheel->slots[level][(tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+			while ((timer = *slot) != NULL)
+			{
+				*slot = timer->next;
+				if (timer->next != NULL)
+					timer->next->pprev = slot;
+				timerLink(wheel, timer);
+			}
+		}
+
+		// Handlers may cancel other timers of this slot: always take the head
+		t_timer **slot = &wheel->slots[0][tick & (WHEEL_SLOTS - 1)];
+		while ((timer = *slot) != NULL)
+		{
+			timerCancel(wheel, timer);
+			timerExpired(srv, timer);
+		}
+	}
+}
+
+/**
+ * @brief Flush the dirty clients once the batching window is over.
+ * @return nanoseconds left in the window, UINT64_MAX if nothing is waiting
+ */
+uint64_t flushBatch(t_server *srv)
+{
+	if (srv->dirty_count == 0)
+		return (UINT64_MAX);
+	uint64_t waited = nowNs() - srv->dirty_since;
+	if (waited >= batch_window_ns)
+	{
+		flushDirty(srv);
+		return (UINT64_MAX);
+	}
+	return (batch_window_ns - waited);
+}
+
+/**
+ * @brief Run the timers and the batch flush that are due, and work out how
+ * long the loop may then wait for events.
+ * @return the wait, NULL for as long as it takes
+ */
+struct timespec *loopTimeout(t_server *srv, struct timespec *timeout)
+{
+	runTimers(srv);
+	uint64_t wait = flushBatch(srv);
+	uint64_t ticks = timerNext(&srv->wheel);
+
+	if (ticks != UINT64_MAX)
+	{
+		uint64_t due = (srv->wheel.now + ticks) * TIMER_TICK_MS * 1000000ULL;
+		uint64_t now = nowNs();
+		uint64_t left = due > now ? due - now : 0;
+		if (left < wait)
+			wait = left;
+	}
+	if (wait == UINT64_MAX)
+		return (NULL);
+	timeout->tv_sec = wait / 1000000000;
+	timeout->tv_nsec = wait % 1000000000;
+	return (timeout);
+}
+
+/**
+ * @brief Event loop of one shard. Only returns on a fatal error.
+ *
+ * Messages queued while handling one wakeup are flushed after it, once per
+ * recipient; with -w the flush waits until the oldest of them has been
+ * queued for the batching window. The wait for events is cut short to
+ * honour that window and the next client timer, so timeouts cost no
+ * system call of their own.
+ */
+void runShard(t_server *srv)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct timespec window;
+	struct timespec *timeout = NULL;
+	int polls;
+
+	while (true)
+	{
+		// Shard 0 carries out a SIGINT/SIGTERM here, outside the handler
+		if (interrupted && srv == &shards[0])
+		{
+			disable_raw_mode();
+			printf("\nChatServer: interrupted, shutting down...\n");
+			exit(EXIT_SUCCESS);
+		}
+		if (srv->backend == BACKEND_URING)
+		{
+			// Submits the sends queued by the previous batch and waits
+			if (uringEnter(srv, true, timeout) == -1)
+			{
+				perror("ChatServer: runShard: io_uring_enter()");
+				return;
+			}
+			metricAdd(&srv->metrics.wakeups, 1);
+			srv->tick = nowTick();
+			uringing(srv);
+			timeout = loopTimeout(srv, &window);
+			continue;
+		}
+
+		metricAdd(&srv->metrics.syscalls, 1);
+		if (srv->backend == BACKEND_EPOLL)
+			polls = epoll_pwait2(srv->epollFd, events, MAX_EVENTS, timeout, NULL);
+		else
+			polls = ppoll(srv->fds, srv->fds_count, timeout, NULL);
+
+		if (polls == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("ChatServer: runShard: poll()");
+			return;
+		}
+		metricAdd(&srv->metrics.wakeups, 1);
+		srv->tick = nowTick();
+
+		if (srv->backend == BACKEND_EPOLL)
+			epolling(srv, events, polls);
+		else
+			polling(srv, polls);
+		timeout = loopTimeout(srv, &window);
+	}
+}
+
+/**
+ * @brief atexit() hook: report how many system calls each relayed frame cost.
+ *
+ * Counters are per shard and read without locking, they are indicative.
+ */
+void printStats(void)
+{
+	unsigned long syscalls = 0, frames = 0;
+
+	for (int s = 0; s < shards_count; s++)
+	{
+		syscalls += metricGet(&shards[s].metrics.syscalls);
+		frames += metricGet(&shards[s].metrics.frames_in);
+	}
+	if (frames > 0)
+		printf("ChatServer: relayed %lu frames with %lu event loop syscalls (%.2f per frame)\n",
+			   frames, syscalls, (double)syscalls / frames);
+}
+
+/**
+ * @brief Sum a counter over all shards.
+ * @param offset Offset of the counter in t_metrics
+ */
+unsigned long sumMetric(size_t offset)
+{
+	unsigned long total = 0;
+
+	for (int s = 0; s < shards_count; s++)
+		total += metricGet((atomic_ulong *)((char *)&shards[s].metrics + offset));
+	return (total);
+}
+
+/**
+ * @brief Write one sample with its HELP and TYPE lines.
+ */
+void printMetric(FILE *out, const char *name, const char *type, const char *help, double value)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.15g\n", name, help, name, type, name, value);
+}
+
+/**
+ * @brief Write every metric in the Prometheus text exposition format.
+ * @param acceptsRate Accepts per second over the last sampling period
+ * @param wakeupsRate Event loop wakeups per second over the last sampling period
+ */
+void writeMetrics(FILE *out, double acceptsRate, double wakeupsRate)
+{
+	unsigned long accepts = sumMetric(offsetof(t_metrics, accepts));
+	unsigned long disconnects = sumMetric(offsetof(t_metrics, disconnects));
+	unsigned long queued = sumMetric(offsetof(t_metrics, queued));
+	unsigned long dequeued = sumMetric(offsetof(t_metrics, dequeued));
+
+	printMetric(out, "chatserver_connections", "gauge", "Connected clients.", accepts - disconnects);
+	printMetric(out, "chatserver_accepts_total", "counter", "Accepted connections.", accepts);
+	printMetric(out, "chatserver_accepts_per_second", "gauge", "Accepted connections per second.", acceptsRate);
+	fprintf(out, "# HELP chatserver_rejected_total Connections closed right after accept()."
+				 "\n# TYPE chatserver_rejected_total counter\n");
+	fprintf(out, "chatserver_rejected_total{reason=\"per_ip\"} %lu\n", sumMetric(offsetof(t_metrics, rejected_ip)));
+	fprintf(out, "chatserver_rejected_total{reason=\"capacity\"} %lu\n",
+			sumMetric(offsetof(t_metrics, rejected_full)));
+	printMetric(out, "chatserver_messages_in_total", "counter", "Frames received from clients.",
+				sumMetric(offsetof(t_metrics, frames_in)));
+	printMetric(out, "chatserver_messages_out_total", "counter", "Messages written to clients.",
+				sumMetric(offsetof(t_metrics, messages_out)));
+	printMetric(out, "chatserver_bytes_in_total", "counter", "Bytes received from clients.",
+				sumMetric(offsetof(t_metrics, bytes_in)));
+	printMetric(out, "chatserver_bytes_out_total", "counter", "Bytes written to clients.",
+				sumMetric(offsetof(t_metrics, bytes_out)));
+	printMetric(out, "chatserver_send_queue_depth", "gauge", "Messages waiting in client outbound queues.",
+				queued - dequeued);
+	printMetric(out, "chatserver_outbound_bytes", "gauge", "Bytes waiting in client outbound queues.",
+				sumMetric(offsetof(t_metrics, outbound_bytes)));
+	fprintf(out, "# HELP chatserver_slow_consumer_total Messages or clients hit by the slow-consumer "
+				 "policy or a full outbound ring.\n# TYPE chatserver_slow_consumer_total counter\n");
+	fprintf(out, "chatserver_slow_consumer_total{action=\"drop_oldest\"} %lu\n",
+			sumMetric(offsetof(t_metrics, slow_dropped)));
+	fprintf(out, "chatserver_slow_consumer_total{action=\"skip\"} %lu\n",
+			sumMetric(offsetof(t_metrics, slow_skipped)));
+	fprintf(out, "chatserver_slow_consumer_total{action=\"disconnect\"} %lu\n",
+			sumMetric(offsetof(t_metrics, slow_evicted)));
+	fprintf(out, "chatserver_slow_consumer_total{action=\"queue_full\"} %lu\n",
+			sumMetric(offsetof(t_metrics, queue_full)));
+	fprintf(out, "chatserver_slow_consumer_total{action=\"flush_deadline\"} %lu\n",
+			sumMetric(offsetof(t_metrics, slow_deadline)));
+	printMetric(out, "chatserver_idle_timeouts_total", "counter", "Clients disconnected for sending nothing.",
+				sumMetric(offsetof(t_metrics, idle_timeouts)));
+	printMetric(out, "chatserver_heartbeats_total", "counter", "Heartbeat frames sent.",
+				sumMetric(offsetof(t_metrics, heartbeats)));
+	printMetric(out, "chatserver_flushes_total", "counter",
+				"Coalesced client writes, each covering every message queued for the client since the last one.",
+				sumMetric(offsetof(t_metrics, flushes)));
+	printMetric(out, "chatserver_relay_links", "gauge", "Relay links up to other nodes.",
+				metricGet(&relay_links_up) - metricGet(&relay_links_down));
+	fprintf(out, "# HELP chatserver_relay_messages_total Messages sent to or received from other nodes."
+				 "\n# TYPE chatserver_relay_messages_total counter\n");
+	fprintf(out, "chatserver_relay_messages_total{direction=\"out\"} %lu\n", metricGet(&relay_sent));
+	fprintf(out, "chatserver_relay_messages_total{direction=\"in\"} %lu\n", metricGet(&relay_received));
+	fprintf(out, "chatserver_relay_messages_total{direction=\"duplicate\"} %lu\n", metricGet(&relay_duplicates));
+	printMetric(out, "chatserver_wakeups_total", "counter", "Event loop wakeups.",
+				sumMetric(offsetof(t_metrics, wakeups)));
+	printMetric(out, "chatserver_wakeups_per_second", "gauge", "Event loop wakeups per second.", wakeupsRate);
+	printMetric(out, "chatserver_syscalls_total", "counter", "Event loop system calls.",
+				sumMetric(offsetof(t_metrics, syscalls)));
+
+	// Buckets are cumulative in the exposition format
+	unsigned long count = 0;
+	fprintf(out, "# HELP chatserver_fanout_latency_seconds Time from receiving a message to queueing it "
+				 "for all recipients of a shard.\n# TYPE chatserver_fanout_latency_seconds histogram\n");
+	for (int b = 0; b <= LATENCY_BUCKETS; b++)
+	{
+		count += sumMetric(offsetof(t_metrics, fanout) + b * sizeof(atomic_ulong));
+		if (b < LATENCY_BUCKETS)
+			fprintf(out, "chatserver_fanout_latency_seconds_bucket{le=\"%g\"} %lu\n",
+					latency_bounds_us[b] / 1e6, count);
+		else
+			fprintf(out, "chatserver_fanout_latency_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+	}
+	fprintf(out, "chatserver_fanout_latency_seconds_sum %.9f\n", sumMetric(offsetof(t_metrics, fanout_ns)) / 1e9);
+	fprintf(out, "chatserver_fanout_latency_seconds_count %lu\n", count);
+}
+
+/**
+ * @brief Answer one admin connection with the metrics page.
+ *
+ * Whatever the request is (an HTTP GET from Prometheus or curl, or nothing
+ * from nc), the reply is the current page.
+ */
+void serveMetrics(int fd, double acceptsRate, double wakeupsRate)
+{
+	struct timeval tv = {.tv_sec = ADMIN_TIMEOUT_MS / 1000, .tv_usec = ADMIN_TIMEOUT_MS % 1000 * 1000};
+	char request[BUFFER_SIZE];
+	char *page = NULL;
+	size_t page_len = 0;
+
+	// A client that never sends nor reads must not stall the admin thread
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	recv(fd, request, sizeof(request), 0);
+
+	FILE *out = open_memstream(&page, &page_len);
+	if (out == NULL)
+	{
+		perror("ChatServer: serveMetrics: open_memstream()");
+		return;
+	}
+	writeMetrics(out, acceptsRate, wakeupsRate);
+	fclose(out);
+
+	char header[BUFFER_SIZE];
+	int header_len = snprintf(header, sizeof(header),
+							  "HTTP/1.0 200 OK\r\n"
+							  "Content-Type: text/plain; version=0.0.4\r\n"
+							  "Content-Length: %zu\r\n"
+							  "Connection: close\r\n\r\n",
+							  page_len);
+	struct iovec iov[2] = {{header, header_len}, {page, page_len}};
+	if (writev(fd, iov, 2) == -1)
+		perror("ChatServer: serveMetrics: writev()");
+	free(page);
+}
+
+/**
+ * @brief Admin thread: serves the metrics page and samples the rates.
+ *
+ * Runs apart from the shards so a scrape never delays client traffic; it
+ * only reads their counters.
+ */
+void *adminThread(void *arg)
+{
+	int adminFd = (int)(intptr_t)arg;
+	struct pollfd pfd = {.fd = adminFd, .events = POLLIN};
+	unsigned long lastAccepts = 0, lastWakeups = 0;
+	double acceptsRate = 0, wakeupsRate = 0;
+	uint64_t last = nowNs();
+
+	while (true)
+	{
+		int ready = poll(&pfd, 1, ADMIN_TIMEOUT_MS);
+
+		uint64_t now = nowNs();
+		if (now - last >= ADMIN_TIMEOUT_MS * 1000000ULL)
+		{
+			unsigned long accepts = sumMetric(offsetof(t_metrics, accepts));
+			unsigned long wakeups = sumMetric(offsetof(t_metrics, wakeups));
+			acceptsRate = (accepts - lastAccepts) * 1e9 / (now - last);
+			wakeupsRate = (wakeups - lastWakeups) * 1e9 / (now - last);
+			lastAccepts = accepts;
+			lastWakeups = wakeups;
+			last = now;
+		}
+		if (ready <= 0)
+			continue;
+
+		int fd = accept(adminFd, NULL, NULL);
+		if (fd == -1)
+			continue;
+		serveMetrics(fd, acceptsRate, wakeupsRate);
+		close(fd);
+	}
+	return (NULL);
+}
+
+/**
+ * @brief Write a 32-bit integer in network byte order.
+ */
+void putBe32(unsigned char *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+/**
+ * @brief Read a 32-bit integer in network byte order.
+ */
+uint32_t getBe32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (ntohl(v));
+}
+
+/**
+ * @brief Write a 64-bit integer in network byte order.
+ */
+void putBe64(unsigned char *p, uint64_t v)
+{
+	v = htobe64(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+/**
+ * @brief Read a 64-bit integer in network byte order.
+ */
+uint64_t getBe64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (be64toh(v));
+}
+
+/**
+ * @brief Bit of a node in the visited set of a relayed message.
+ */
+static inline uint64_t nodeBit(unsigned node)
+{
+	return (1ULL << (node - 1));
+}
+
+/**
+ * @brief Record a relayed message; tells whether it was seen before.
+ *
+ * Messages more than RELAY_WINDOW behind the newest one of their origin,
+ * or from an older incarnation of it, count as seen.
+ */
+bool relaySeen(unsigned origin, uint64_t inc, uint64_t seq)
+{
+	t_origin *o = &origins[origin];
+
+	if (inc < o->incarnation)
+		return (true);
+	if (inc > o->incarnation)
+	{
+		o->incarnation = inc;
+		o->seq = seq;
+		o->seen = 1;
+		return (false);
+	}
+	if (seq > o->seq)
+	{
+		uint64_t ahead = seq - o->seq;
+		o->seen = (ahead >= RELAY_WINDOW ? 0 : o->seen << ahead) | 1;
+		o->seq = seq;
+		return (false);
+	}
+	uint64_t behind = o->seq - seq;
+	if (behind >= RELAY_WINDOW || (o->seen & (1ULL << behind)) != 0)
+		return (true);
+	o->seen |= 1ULL << behind;
+	return (false);
+}
+
+/**
+ * @brief Close a relay link; a dialled one is redialled after RELAY_RETRY_MS.
+ */
+void linkClose(int l)
+{
+	t_link *link = &links[l];
+
+	if (link->node != 0)
+	{
+		logLine("ChatServer: relay link to node %u down", link->node);
+		metricAdd(&relay_links_down, 1);
+	}
+	close(link->fd);
+	for (; link->queue_count > 0; link->queue_count--)
+	{
+		releaseMessage(link->queue[link->queue_head]);
+		link->queue_head = (link->queue_head + 1) % link->queue_capacity;
+	}
+	free(link->queue);
+	free(link->in);
+	if (link->relay >= 0)
+	{
+		relays[link->relay].link = -1;
+		relays[link->relay].retry_ns = nowNs() + RELAY_RETRY_MS * 1000000ULL;
+	}
+	*link = (t_link){.fd = -1, .relay = -1};
+}
+
+/**
+ * @brief Write as much of a link's queue as the socket takes.
+ */
+void linkFlush(int l)
+{
+	t_link *link = &links[l];
+	struct iovec iov[FLUSH_BATCH * 2];
+
+	while (link->queue_count > 0)
+	{
+		int n = 0;
+		size_t skip = link->queue_sent;
+		for (int q = 0; q < link->queue_count && q < FLUSH_BATCH; q++)
+		{
+			n += messageIov(link->queue[(link->queue_head + q) % link->queue_capacity], skip, iov + n);
+			skip = 0;
+		}
+		ssize_t sent = writev(link->fd, iov, n);
+		if (sent == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				linkClose(l);
+			return;
+		}
+
+		// Release every message now fully written
+		size_t done = link->queue_sent + sent;
+		link->queue_bytes -= sent;
+		while (link->queue_count > 0)
+		{
+			t_message *msg = link->queue[link->queue_head];
+			if (done < msg->header_len + msg->len)
+				break;
+			done -= msg->header_len + msg->len;
+			releaseMessage(msg);
+			link->queue_head = (link->queue_head + 1) % link->queue_capacity;
+			link->queue_count--;
+		}
+		link->queue_sent = done;
+	}
+}
+
+/**
+ * @brief Queue a message on a relay link; it goes out with the next flush.
+ *
+ * A full ring is flushed before it grows, so a burst does not pile up
+ * more than the socket cannot take.
+ * @return 0 on success, -1 if the link fell RELAY_OUTQ_BYTES behind and
+ * was closed
+ */
+int linkSend(int l, t_message *msg)
+{
+	t_link *link = &links[l];
+
+	if (link->queue_count == link->queue_capacity && !link->connecting && link->queue_count > 0)
+	{
+		linkFlush(l);
+		if (link->fd == -1)
+			return (-1);
+	}
+	if (link->queue_bytes + msg->header_len + msg->len > RELAY_OUTQ_BYTES)
+	{
+		logLine("ChatServer: relay link to node %u fell behind, closing", link->node);
+		linkClose(l);
+		return (-1);
+	}
+	if (link->queue_count == link->queue_capacity)
+	{
+		int capacity = link->queue_capacity ? link->queue_capacity * 2 : OUTQ_MIN;
+		t_message **grown = malloc(capacity * sizeof(t_message *));
+		if (grown == NULL)
+		{
+			perror("ChatServer: linkSend: malloc()");
+			linkClose(l);
+			return (-1);
+		}
+		// Unwrap the ring so the oldest message is at index 0
+		for (int q = 0; q < link->queue_count; q++)
+			grown[q] = link->queue[(link->queue_head + q) % link->queue_capacity];
+		free(link->queue);
+		link->queue = grown;
+		link->queue_head = 0;
+		link->queue_capacity = capacity;
+	}
+	link->queue[(link->queue_head + link->queue_count) % link->queue_capacity] = retainMessage(msg);
+	link->queue_count++;
+	link->queue_bytes += msg->header_len + msg->len;
+	return (0);
+}
+
+/**
+ * @brief Take a connected (or connecting) socket as a relay link and say hello.
+ * @param relay Index in relays for a dialled link, -1 for an accepted one
+ * @return the link index, -1 on failure (fd closed)
+ */
+int linkOpen(int fd, int relay, bool connecting)
+{
+	unsigned char hello[4];
+	int one = 1;
+	int l = 0;
+
+	while (l < MAX_LINKS && links[l].fd != -1)
+		l++;
+	if (l == MAX_LINKS)
+	{
+		logLine("ChatServer: too many relay links, closing fd %d", fd);
+		close(fd);
+		return (-1);
+	}
+	// Relay messages are small and already batched per loop iteration
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	links[l] = (t_link){.fd = fd, .relay = relay, .connecting = connecting};
+	if (relay >= 0)
+		relays[relay].link = l;
+
+	putBe32(hello, node_id);
+	t_message *msg = newMessage(FRAME_HELLO, "", (const char *)hello, sizeof(hello));
+	if (msg == NULL)
+	{
+		linkClose(l);
+		return (-1);
+	}
+	int rv = linkSend(l, msg);
+	releaseMessage(msg);
+	return (rv == 0 ? l : -1);
+}
+
+/**
+ * @brief Start a non-blocking connect to a -R peer.
+ *
+ * Skipped while the peer is already linked through a connection it dialled
+ * itself. Name resolution blocks, but only the relay thread.
+ */
+void relayDial(int r)
+{
+	t_relay *relay = &relays[r];
+	struct addrinfo hints = {0}, *res, *p;
+
+	relay->retry_ns = nowNs() + RELAY_RETRY_MS * 1000000ULL;
+	if (relay->node == node_id)
+		return;
+	for (int l = 0; l < MAX_LINKS && relay->node != 0; l++)
+	{
+		if (links[l].fd != -1 && links[l].node == relay->node)
+			return;
+	}
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(relay->host, relay->port, &hints, &res) != 0)
+		return;
+	for (p = res; p != NULL; p = p->ai_next)
 	{
-		if ((*fds)[i].revents & (POLLIN | POLLHUP))
+		int fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (connect(fd, p->ai_addr, p->ai_addrlen) == 0 || errno == EINPROGRESS)
 		{
-			if ((*fds)[i].fd == serverFd)
-				addNewConnection(serverFd, fds, fds_count, fds_capacity);
-			else if ((*fds)[i].fd == STDIN_FILENO)
-				handleServerInput(serverFd, fds, fds_count);
-			else
-				handleClientMessage(serverFd, fds, fds_count, fds_capacity, &i);
-			polled++;
+			linkOpen(fd, r, true);
+			break;
 		}
+		close(fd);
 	}
+	freeaddrinfo(res);
 }
 
-int main(void)
+/**
+ * @brief Handle a FRAME_HELLO: learn the node at the other end of a link.
+ *
+ * Two nodes dialling each other end up with two links; both keep the one
+ * dialled by the lower node id, so they agree on which one to close. A new
+ * link dialled by the same side replaces the old one, which is stale.
+ */
+void linkHello(int l, const unsigned char *p, size_t len)
 {
-	struct addrinfo hints, *serverAddr;
-	const char *port = DEFAULT_PORT;
+	t_link *link = &links[l];
 
-	setbuf(stdout, NULL); // Disable buffering for stdout
-	setbuf(stderr, NULL); // Disable buffering for stderr
+	if (len < 4 || link->node != 0)
+		return;
+	unsigned node = getBe32(p);
+	if (link->relay >= 0)
+		relays[link->relay].node = node;
+	if (node == 0 || node > MAX_NODES || node == node_id)
+	{
+		logLine("ChatServer: relay link to node %u refused%s", node,
+				node == node_id ? " (it is this node)" : "");
+		linkClose(l);
+		return;
+	}
 
-	hints = (struct addrinfo){0};
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;
+	unsigned dialler = link->relay >= 0 ? node_id : node;
+	for (int o = 0; o < MAX_LINKS; o++)
+	{
+		if (o == l || links[o].fd == -1 || links[o].node != node)
+			continue;
+		unsigned other = links[o].relay >= 0 ? node_id : node;
+		if (dialler != other && dialler != (node < node_id ? node : node_id))
+		{
+			linkClose(l);
+			return;
+		}
+		linkClose(o);
+	}
+	link->node = node;
+	metricAdd(&relay_links_up, 1);
+	logLine("ChatServer: relay link to node %u up", node);
+}
 
-	// Resolve local address
-	int rv;
-	if ((rv = getaddrinfo(NULL, port, &hints, &serverAddr)) != 0)
+/**
+ * @brief Send a relay payload to every linked node it has not visited yet.
+ *
+ * Those nodes join its visited set first, so in a full mesh nobody forwards
+ * it again; copies that still meet on other topologies are dropped by
+ * relaySeen. Every node gets one copy, whatever its number of clients.
+ * @param payload Updated in place with the new visited set
+ */
+void relaySend(unsigned char *payload, size_t len)
+{
+	uint64_t visited = getBe64(payload + 20);
+	uint64_t targets = 0;
+
+	for (int l = 0; l < MAX_LINKS; l++)
 	{
-		fprintf(stderr, "ChatServer: getaddrinfo(): %s\n",
-				gai_strerror(rv));
-		return (EXIT_FAILURE);
+		if (links[l].fd != -1 && links[l].node != 0 && (visited & nodeBit(links[l].node)) == 0)
+			targets |= nodeBit(links[l].node);
+	}
+	if (targets == 0)
+		return;
+	putBe64(payload + 20, visited | targets);
+	t_message *msg = newMessage(FRAME_RELAY, "", (const char *)payload, len);
+	if (msg == NULL)
+		return;
+	for (int l = 0; l < MAX_LINKS; l++)
+	{
+		if (links[l].fd != -1 && links[l].node != 0 && (targets & nodeBit(links[l].node)) != 0 &&
+			linkSend(l, msg) == 0)
+			metricAdd(&relay_sent, 1);
 	}
+	releaseMessage(msg);
+}
 
-	// Create and bind TCP socket
-	int serverFd, yes = 1;
-	struct addrinfo *p;
-	for (p = serverAddr; p != NULL; p = p->ai_next)
+/**
+ * @brief Handle a FRAME_RELAY: deliver a message from another node to the
+ * local members of its room, then pass it on.
+ */
+void linkRelay(const unsigned char *p, size_t len)
+{
+	if (len < RELAY_HEADER_SIZE)
+		return;
+	unsigned origin = getBe32(p);
+	size_t room_len = p[28], prefix_len = p[29];
+	if (origin == 0 || origin > MAX_NODES || room_len > ROOM_NAME_MAX ||
+		prefix_len > HEADER_SIZE - FRAME_HEADER_SIZE || RELAY_HEADER_SIZE + room_len + prefix_len > len)
+		return;
+	if (origin == node_id || relaySeen(origin, getBe64(p + 4), getBe64(p + 12)))
 	{
-		// Create socket
-		if ((serverFd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+		metricAdd(&relay_duplicates, 1);
+		return;
+	}
+
+	char prefix[HEADER_SIZE];
+	const char *text = (const char *)p + RELAY_HEADER_SIZE + room_len + prefix_len;
+	memcpy(prefix, p + RELAY_HEADER_SIZE + room_len, prefix_len);
+	prefix[prefix_len] = '\0';
+	t_message *msg = newMessage(FRAME_CHAT, prefix, text, len - (RELAY_HEADER_SIZE + room_len + prefix_len));
+	if (msg != NULL)
+	{
+		msg->to_room = true;
+		memcpy(msg->room, p + RELAY_HEADER_SIZE, room_len);
+		msg->room[room_len] = '\0';
+		if (!headless && msg->room[0] != '\0')
+			logLine("[%s] %s%.*s", msg->room, prefix, (int)msg->len, msg->data);
+		else if (!headless)
+			logLine("%s%.*s", prefix, (int)msg->len, msg->data);
+		broadcastShards(NULL, msg);
+		historyAppend(msg);
+		releaseMessage(msg);
+		metricAdd(&relay_received, 1);
+	}
+	relaySend((unsigned char *)p, len);
+}
+
+/**
+ * @brief Read from a relay link and handle every complete frame.
+ */
+void linkRead(int l)
+{
+	t_link *link = &links[l];
+
+	while (true)
+	{
+		if (link->in_capacity - link->in_len < RECV_SIZE)
 		{
-			perror("ChatServer: main: socket()");
-			continue;
+			size_t capacity = link->in_capacity ? link->in_capacity * 2 : RECV_SIZE * 2;
+			char *grown = realloc(link->in, capacity);
+			if (grown == NULL)
+			{
+				perror("ChatServer: linkRead: realloc()");
+				linkClose(l);
+				return;
+			}
+			link->in = grown;
+			link->in_capacity = capacity;
+		}
+		ssize_t n = recv(link->fd, link->in + link->in_len, link->in_capacity - link->in_len, 0);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0)
+		{
+			linkClose(l);
+			return;
 		}
+		link->in_len += n;
 
-		// Set socket options
-		if (setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+		size_t used = 0;
+		while (link->in_len - used >= FRAME_HEADER_SIZE)
 		{
-			perror("ChatServer: main: setsockopt()");
-			close(serverFd);
-			continue;
+			unsigned char *hdr = (unsigned char *)link->in + used;
+			uint32_t len = frameLength(hdr);
+			if (len > RELAY_FRAME_MAX)
+			{
+				logLine("ChatServer: relay link to node %u sent an invalid frame, closing", link->node);
+				linkClose(l);
+				return;
+			}
+			if (link->in_len - used < FRAME_HEADER_SIZE + len)
+				break;
+			if (hdr[4] == FRAME_HELLO)
+				linkHello(l, hdr + FRAME_HEADER_SIZE, len);
+			else if (hdr[4] == FRAME_RELAY && link->node != 0)
+				linkRelay(hdr + FRAME_HEADER_SIZE, len);
+			if (link->fd == -1)
+				return;
+			used += FRAME_HEADER_SIZE + len;
 		}
+		memmove(link->in, link->in + used, link->in_len - used);
+		link->in_len -= used;
+	}
+}
 
-		// Bind socket
-		if (bind(serverFd, p->ai_addr, p->ai_addrlen) == -1)
+/**
+ * @brief Encode a message of a local client as a relay payload and send it
+ * to every linked node.
+ *
+ * Its "Client N: " prefix becomes "Client N@NODE: ", so that clients can
+ * tell senders of different nodes apart.
+ */
+void relayLocal(const t_message *msg)
+{
+	static unsigned char payload[RELAY_FRAME_MAX];
+	const char *prefix = msg->header + FRAME_HEADER_SIZE;
+	int prefix_len = msg->header_len - FRAME_HEADER_SIZE;
+	size_t room_len = strlen(msg->room);
+	char qualified[HEADER_SIZE];
+
+	if (prefix_len >= 2 && memcmp(prefix + prefix_len - 2, ": ", 2) == 0)
+		prefix_len = snprintf(qualified, sizeof(qualified), "%.*s@%u: ", prefix_len - 2, prefix, node_id);
+	else
+		prefix_len = snprintf(qualified, sizeof(qualified), "%.*s", prefix_len, prefix);
+	if (prefix_len > HEADER_SIZE - FRAME_HEADER_SIZE)
+		prefix_len = HEADER_SIZE - FRAME_HEADER_SIZE;
+
+	putBe32(payload, node_id);
+	putBe64(payload + 4, incarnation);
+	putBe64(payload + 12, ++relay_seq);
+	putBe64(payload + 20, nodeBit(node_id));
+	payload[28] = room_len;
+	payload[29] = prefix_len;
+	memcpy(payload + RELAY_HEADER_SIZE, msg->room, room_len);
+	memcpy(payload + RELAY_HEADER_SIZE + room_len, qualified, prefix_len);
+	memcpy(payload + RELAY_HEADER_SIZE + room_len + prefix_len, msg->data, msg->len);
+	relaySend(payload, RELAY_HEADER_SIZE + room_len + prefix_len + msg->len);
+}
+
+/**
+ * @brief Send every message the shards handed to the relay thread.
+ */
+void relayDrain(void)
+{
+	static t_message **spare = NULL;
+	static int spare_capacity = 0;
+	eventfd_t wakeups;
+
+	// Reset the counter first so a message queued after the swap re-arms it
+	eventfd_read(relay_wake_fd, &wakeups);
+
+	pthread_mutex_lock(&relay_lock);
+	t_message **batch = relay_inbox;
+	int count = relay_inbox_count;
+	int capacity = relay_inbox_capacity;
+	relay_inbox = spare;
+	relay_inbox_capacity = spare_capacity;
+	relay_inbox_count = 0;
+	pthread_mutex_unlock(&relay_lock);
+	spare = batch;
+	spare_capacity = capacity;
+
+	for (int m = 0; m < count; m++)
+	{
+		relayLocal(batch[m]);
+		releaseMessage(batch[m]);
+	}
+}
+
+/**
+ * @brief Relay thread: keeps the links to the other nodes of the cluster.
+ *
+ * Accepts links on the relay port (-L), dials the -R peers and redials them
+ * when a link drops, sends what local clients say to the other nodes and
+ * hands what they relay to the shards. Each message crosses a link once,
+ * however many clients the node at the other end has.
+ */
+void *relayThread(void *arg)
+{
+	int relayFd = (int)(intptr_t)arg;
+	struct pollfd fds[MAX_LINKS + 2];
+
+	for (int l = 0; l < MAX_LINKS; l++)
+		links[l] = (t_link){.fd = -1, .relay = -1};
+	while (true)
+	{
+		uint64_t now = nowNs();
+		int timeout = -1;
+		for (int r = 0; r < relays_count; r++)
 		{
-			perror("ChatServer: main: bind()");
-			close(serverFd);
-			continue;
+			if (relays[r].link == -1 && relays[r].retry_ns <= now)
+				relayDial(r);
+			if (relays[r].link != -1)
+				continue;
+			int ms = (relays[r].retry_ns - now) / 1000000 + 1;
+			if (timeout == -1 || ms < timeout)
+				timeout = ms;
 		}
 
-		break; // Successfully bound
+		fds[0] = (struct pollfd){.fd = relayFd, .events = POLLIN};
+		fds[1] = (struct pollfd){.fd = relay_wake_fd, .events = POLLIN};
+		for (int l = 0; l < MAX_LINKS; l++)
+		{
+			bool out = links[l].connecting || links[l].queue_count > 0;
+			fds[l + 2] = (struct pollfd){.fd = links[l].fd, .events = POLLIN | (out ? POLLOUT : 0)};
+		}
+		if (poll(fds, MAX_LINKS + 2, timeout) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("ChatServer: relayThread: poll()");
+			disable_raw_mode();
+			exit(EXIT_FAILURE);
+		}
+
+		for (int l = 0; l < MAX_LINKS; l++)
+		{
+			if (fds[l + 2].revents == 0 || links[l].fd == -1)
+				continue;
+			if (links[l].connecting)
+			{
+				int err = 0;
+				socklen_t err_len = sizeof(err);
+				getsockopt(links[l].fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+				if (err != 0)
+				{
+					linkClose(l);
+					continue;
+				}
+				links[l].connecting = false;
+			}
+			if (fds[l + 2].revents & (POLLIN | POLLHUP | POLLERR))
+				linkRead(l);
+		}
+		if (fds[0].revents & POLLIN)
+		{
+			int fd;
+			while ((fd = accept4(relayFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+				linkOpen(fd, -1, false);
+		}
+		if (fds[1].revents & POLLIN)
+			relayDrain();
+
+		// Everything queued this iteration goes out in one write per link
+		for (int l = 0; l < MAX_LINKS; l++)
+		{
+			if (links[l].fd != -1 && !links[l].connecting && links[l].queue_count > 0)
+				linkFlush(l);
+		}
 	}
+	return (NULL);
+}
 
-	freeaddrinfo(serverAddr);
+/**
+ * @brief Name of a backend, for logging.
+ */
+const char *backend_name(t_backend backend)
+{
+	if (backend == BACKEND_URING)
+		return ("io_uring");
+	if (backend == BACKEND_EPOLL)
+		return ("epoll");
+	return ("poll");
+}
 
-	if (p == NULL)
+/**
+ * @brief pthread entry point for shards 1..N-1. A dead shard takes the
+ * whole server down, like a failing main loop does.
+ */
+void *shardThread(void *arg)
+{
+	runShard((t_server *)arg);
+	disable_raw_mode();
+	exit(EXIT_FAILURE);
+	return (NULL);
+}
+
+/**
+ * @brief Main entry point. Relays messages between all connected chat clients.
+ */
+int main(int argc, char *const argv[])
+{
+	const char *port = DEFAULT_PORT;
+	const char *adminPort = NULL;
+	const char *relayPort = NULL;
+	t_backend backend = BACKEND_EPOLL;
+	int opt;
+
+	// Parse arguments: [-d] [-a FAMILY] [-l BACKLOG] [-c CONNS_PER_IP] [-b BACKEND] [-t THREADS] [-m ADMIN_PORT]
+	// [-q BYTES] [-Q BYTES] [-P POLICY] [-w USEC] [-i SECONDS] [-k SECONDS] [-D SECONDS]
+	// [-H DIR [-n REPLAY]] [-N NODE_ID [-L RELAY_PORT] [-R HOST:PORT]...] [PORT]
+	while ((opt = getopt(argc, argv, "da:l:c:b:t:m:H:n:q:Q:P:w:i:k:D:N:L:R:")) != -1)
 	{
-		fprintf(stderr, "ChatServer: failed to bind\n");
+		if (opt == 'N' && (node_id = atoi(optarg)) >= 1 && node_id <= MAX_NODES)
+			continue;
+		if (opt == 'L')
+		{
+			relayPort = optarg;
+			continue;
+		}
+		if (opt == 'R' && parse_relay(optarg) == 0)
+			continue;
+		if ((opt == 'i' || opt == 'k' || opt == 'D') && atoi(optarg) >= 0)
+		{
+			uint64_t ticks = atoi(optarg) * 1000ULL / TIMER_TICK_MS;
+			if (opt == 'i')
+				idle_ticks = ticks;
+			else if (opt == 'k')
+				heartbeat_ticks = ticks;
+			else
+				flush_deadline_ticks = ticks;
+			continue;
+		}
+		if (opt == 'w' && atol(optarg) >= 0)
+		{
+			batch_window_ns = atol(optarg) * 1000;
+			continue;
+		}
+		if (opt == 'H')
+		{
+			history_dir = optarg;
+			continue;
+		}
+		if (opt == 'n' && (history_replay = atoi(optarg)) >= 0 && history_replay <= HISTORY_RING)
+			continue;
+		if (opt == 'q' && (client_outq_bytes = strtoul(optarg, NULL, 10)) > 0)
+			continue;
+		if (opt == 'Q' && (global_outq_bytes = strtoul(optarg, NULL, 10)) > 0)
+			continue;
+		if (opt == 'P' && parse_policy(optarg) == 0)
+			continue;
+		if (opt == 'd')
+		{
+			headless = true;
+			continue;
+		}
+		if (opt == 'a' && parse_family(optarg) == 0)
+			continue;
+		if (opt == 'l' && (listen_backlog = atoi(optarg)) >= 1)
+			continue;
+		if (opt == 'c' && (conns_per_ip = atoi(optarg)) >= 0)
+			continue;
+		if (opt == 'b' && parse_backend(optarg, &backend) == 0)
+			continue;
+		if (opt == 't' && (shards_count = atoi(optarg)) >= 1 && shards_count <= MAX_THREADS)
+			continue;
+		if (opt == 'm')
+		{
+			adminPort = optarg;
+			continue;
+		}
+		fprintf(stderr, USAGE);
 		return (EXIT_FAILURE);
 	}
-
-	// Listen for incoming connections
-	if (listen(serverFd, BACKLOG) == -1)
+	if (argc - optind > 1 || ((relayPort != NULL || relays_count > 0) && node_id == 0))
 	{
-		perror("ChatServer: main: listen()");
-		close(serverFd);
+		fprintf(stderr, USAGE);
 		return (EXIT_FAILURE);
 	}
+	if (optind < argc)
+		port = argv[optind];
 
-	printf("ChatServer: listening on port %s\n", port);
+	// Without a terminal (e.g. a container without a TTY) there is no operator
+	if (!isatty(STDIN_FILENO))
+		headless = true;
 
-	// Set up signal handlers to restore terminal on exit
-	signal(SIGINT, signal_handler);
-	signal(SIGTERM, signal_handler);
-	signal(SIGPIPE, SIG_IGN); // Ignore SIGPIPE to prevent crashes on client disconnect
+	// Recursive, see tty_lock
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&tty_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
 
-	int fds_capacity = 10, fds_count = 0;
-	struct pollfd *fds = malloc(fds_capacity * sizeof(struct pollfd));
-	if (fds == NULL)
+	setbuf(stdout, NULL); // Disable buffering for stdout
+	setbuf(stderr, NULL); // Disable buffering for stderr
+
+	// The session table covers every fd this process may open
+	struct rlimit rl;
+	sessions_max = MAX_SESSIONS;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)MAX_SESSIONS)
+		sessions_max = rl.rlim_cur;
+
+	shard_outq_bytes = global_outq_bytes / shards_count;
+
+	shards = calloc(shards_count, sizeof(t_server));
+	sessions = calloc(sessions_max, sizeof(t_client *));
+	if (shards == NULL || sessions == NULL)
 	{
-		perror("ChatServer: main: malloc()");
-		close(serverFd);
+		perror("ChatServer: main: calloc()");
 		return (EXIT_FAILURE);
 	}
+	for (int s = 0; s < shards_count; s++)
+	{
+		if (initShard(&shards[s], s, backend, port, s == 0 && !headless) == -1)
+			return (EXIT_FAILURE);
+	}
 
-	// Add server socket
-	fds[0].fd = serverFd;
-	fds[0].events = POLLIN;
-	fds_count++;
+	if (history_dir != NULL)
+	{
+		pthread_t historian;
+		if (openHistory() == -1)
+			return (EXIT_FAILURE);
+		if ((errno = pthread_create(&historian, NULL, historyThread, NULL)) != 0)
+		{
+			perror("ChatServer: main: pthread_create()");
+			return (EXIT_FAILURE);
+		}
+		printf("ChatServer: history in %s, %d messages indexed, replaying %d\n",
+			   history_dir, history_count, history_replay);
+	}
 
-	// Add standard input
-	fds[1].fd = STDIN_FILENO;
-	fds[1].events = POLLIN;
-	fds_count++;
+	if (node_id != 0)
+	{
+		struct timespec ts;
+		int relayFd = -1;
+		pthread_t relayer;
 
-	// Enable raw mode for character-by-character input
-	enable_raw_mode();
+		// A restarted node must not look like a replay of its previous run
+		clock_gettime(CLOCK_REALTIME, &ts);
+		incarnation = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		if ((relay_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		{
+			perror("ChatServer: main: eventfd()");
+			return (EXIT_FAILURE);
+		}
+		if (relayPort != NULL && (relayFd = createListener(relayPort, false)) == -1)
+			return (EXIT_FAILURE);
+		if ((errno = pthread_create(&relayer, NULL, relayThread, (void *)(intptr_t)relayFd)) != 0)
+		{
+			perror("ChatServer: main: pthread_create()");
+			return (EXIT_FAILURE);
+		}
+		printf("ChatServer: node %u, relay port %s, %d peer%s\n", node_id,
+			   relayPort != NULL ? relayPort : "off", relays_count, relays_count != 1 ? "s" : "");
+	}
 
-	printf("ChatServer: waiting for connections...\n");
-	printf("ChatServer: type messages to broadcast, 'exit' or 'quit' to shutdown\n");
-	printf("Server: ");
-	fflush(stdout);
+	printf("ChatServer: listening on port %s (%s backend, %d thread%s)\n", port,
+		   backend_name(shards[0].backend),
+		   shards_count, shards_count > 1 ? "s" : "");
 
-	int polls;
-	while (true)
+	atexit(printStats);
+	atexit(flushLog); // Runs first, so the summary comes after the last log lines
+
+	// Set up signal handlers to restore terminal on exit
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+	signal(SIGPIPE, SIG_IGN); // Ignore SIGPIPE to prevent crashes on client disconnect
+
+	// Enable raw mode for character-by-character input
+	if (!headless)
+		enable_raw_mode();
+	else
+	{
+		pthread_t logger;
+		if ((errno = pthread_create(&logger, NULL, logThread, NULL)) != 0)
+		{
+			perror("ChatServer: main: pthread_create()");
+			return (EXIT_FAILURE);
+		}
+	}
+
+	for (int s = 1; s < shards_count; s++)
 	{
-		polls = poll(fds, fds_count, -1);
+		if ((errno = pthread_create(&shards[s].thread, NULL, shardThread, &shards[s])) != 0)
+		{
+			perror("ChatServer: main: pthread_create()");
+			disable_raw_mode();
+			return (EXIT_FAILURE);
+		}
+	}
 
-		if (polls == -1)
+	if (adminPort != NULL)
+	{
+		int adminFd = createListener(adminPort, false);
+		pthread_t admin;
+		if (adminFd == -1 ||
+			(errno = pthread_create(&admin, NULL, adminThread, (void *)(intptr_t)adminFd)) != 0)
 		{
-			perror("ChatServer: main: poll()");
+			if (adminFd != -1)
+				perror("ChatServer: main: pthread_create()");
 			disable_raw_mode();
-			free(fds);
-			close(serverFd);
 			return (EXIT_FAILURE);
 		}
+		printf("ChatServer: metrics on port %s\n", adminPort);
+	}
 
-		polling(serverFd, &fds, &fds_count, &fds_capacity, polls);
+	printf("ChatServer: waiting for connections...\n");
+	if (!headless)
+	{
+		printf("ChatServer: type messages to broadcast, 'exit' or 'quit' to shutdown\n");
+		printf("Server: ");
+		fflush(stdout);
 	}
 
-	// This should never be reached, but just in case
+	runShard(&shards[0]);
+
 	disable_raw_mode();
-	return (EXIT_SUCCESS);
+	return (EXIT_FAILURE);
 }
@@ -4,20 +4,84 @@
  * @brief TCP client: connects to server and prints received message.
  *
  * Usage: client hostname [PORT]
+ *        client -b [-n CONNECTIONS] [-c CONCURRENCY] hostname [PORT]
+ *   - -b runs a benchmark instead: CONNECTIONS connections (default: 10000)
+ *     are opened, read to the end and closed, by CONCURRENCY threads at once
+ *     (default: 1). Prints the connection rate and histograms of the connect
+ *     latency and of the transfer throughput of each connection.
  *   - If PORT is omitted, uses default 4242.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <iso646.h>
 
 #define PORT "4242"
-#define MAXDSIZE 10
+#define RECV_SIZE 65536 // One read takes everything the socket has, up to this
+#define DEFAULT_CONNECTIONS 10000
+#define MAX_CONCURRENCY 1024
+#define HIST_SUB_BITS 4 // 16 sub-buckets per power of two: <= 6% error
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+#define CONNECT_STAGGER_MS 250	  // Head start of an address over the next one
+#define ADDR_CACHE_TTL_MS 60000 // Lookups are reused for this long
+#define MAX_CANDIDATES 16
+#define USAGE                                 \
+	"Usage: client hostname [PORT]\n"         \
+	"       client -b [-n CONNECTIONS] [-c CONCURRENCY] hostname [PORT]\n"
 
+/**
+ * @brief Resolved addresses of one host and port, reused across connects.
+ */
+typedef struct s_addr_cache
+{
+	char host[256];
+	char port[32];
+	int family;
+	int socktype;
+	struct addrinfo *list;
+	const struct addrinfo *order[MAX_CANDIDATES]; // Connect order, last winner first
+	int count;
+	int64_t expires; // monotonicMs() after which the lookup is redone
+} t_addr_cache;
+
+/**
+ * @brief Log-linear histogram of 64-bit samples.
+ */
+typedef struct s_hist
+{
+	unsigned long counts[HIST_BUCKETS];
+	unsigned long total;
+	uint64_t max;
+} t_hist;
+
+/**
+ * @brief One benchmark thread and what it measured.
+ */
+typedef struct s_bench
+{
+	pthread_t thread;
+	const char *hostname;
+	const char *port;
+	t_addr_cache cache; // Own lookup and winner, no locking between threads
+	t_hist connect;				 // Connect latency, ns
+	t_hist throughput;			 // Bytes per second of each transfer
+	unsigned long long bytes;
+	unsigned long failed;
+} t_bench;
+
+static atomic_long remaining; // Connections left to open, across threads
 
 /**
  * @brief Extracts pointer to IPv4 or IPv6 address from sockaddr.
@@ -29,73 +93,480 @@ void *getinaddr(struct sockaddr *sa)
 	return (&(((struct sockaddr_in6 *)sa)->sin6_addr));
 }
 
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/**
+ * @brief Histogram bucket of a sample: exact below 16, then 16 buckets
+ * per power of two.
+ */
+int histIndex(uint64_t value)
+{
+	if (value < (1 << HIST_SUB_BITS))
+		return ((int)value);
+	int msb = 63 - __builtin_clzll(value);
+	int sub = (value >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+	return (((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub);
+}
+
+/**
+ * @brief Upper bound of the samples falling into a bucket.
+ */
+uint64_t histValue(int index)
+{
+	if (index < (1 << HIST_SUB_BITS))
+		return (index);
+	int msb = (index >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+	uint64_t sub = index & ((1 << HIST_SUB_BITS) - 1);
+	return ((((1ULL << HIST_SUB_BITS) + sub + 1) << (msb - HIST_SUB_BITS)) - 1);
+}
+
+/**
+ * @brief Record one sample.
+ */
+void histAdd(t_hist *hist, uint64_t value)
+{
+	hist->counts[histIndex(value)]++;
+	hist->total++;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/**
+ * @brief Add the samples of `from` to `into`.
+ */
+void histMerge(t_hist *into, const t_hist *from)
+{
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		into->counts[i] += from->counts[i];
+	into->total += from->total;
+	if (from->max > into->max)
+		into->max = from->max;
+}
+
+/**
+ * @brief Value below which `fraction` of the samples fall.
+ */
+uint64_t percentile(const t_hist *hist, double fraction)
+{
+	unsigned long target = (unsigned long)(fraction * hist->total);
+	unsigned long seen = 0;
+
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += hist->counts[i];
+		// The bucket's upper bound can overshoot the largest sample
+		if (seen > target)
+			return (histValue(i) < hist->max ? histValue(i) : hist->max);
+	}
+	return (hist->max);
+}
+
+/**
+ * @brief Print percentiles, then one bar per power of two holding samples.
+ *
+ * Values are divided by `scale` and shown in `unit`.
+ */
+void printHistogram(const char *name, const t_hist *hist, double scale, const char *unit)
+{
+	unsigned long rows[64] = {0}, top = 0;
+
+	printf("client: %s p1 %.4g, p50 %.4g, p99 %.4g, p99.9 %.4g, max %.4g %s\n", name,
+		   percentile(hist, 0.01) / scale, percentile(hist, 0.50) / scale,
+		   percentile(hist, 0.99) / scale, percentile(hist, 0.999) / scale,
+		   hist->max / scale, unit);
+	for (int i = 0; i < HIST_BUCKETS; i++)
+	{
+		int row = histValue(i) ? 63 - __builtin_clzll(histValue(i)) : 0;
+		rows[row] += hist->counts[i];
+		if (rows[row] > top)
+			top = rows[row];
+	}
+	for (int row = 0; row < 64; row++)
+	{
+		if (rows[row] == 0)
+			continue;
+		char bar[41];
+		int width = (int)(rows[row] * 40 / top);
+		memset(bar, '#', width);
+		bar[width] = '\0';
+		printf("  < %10.4g %-4s %9lu  %s\n", (double)(2ULL << row) / scale, unit, rows[row], bar);
+	}
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in milliseconds.
+ */
+int64_t monotonicMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * @brief Free the addresses held by the cache.
+ */
+void releaseAddrCache(t_addr_cache *cache)
+{
+	if (cache->list != NULL)
+		freeaddrinfo(cache->list);
+	cache->list = NULL;
+	cache->count = 0;
+}
+
+/**
+ * @brief Resolve `host` and `port` unless the cache still holds them.
+ *
+ * Addresses are ordered for connectRace(): families alternate, starting
+ * with the family getaddrinfo() preferred.
+ *
+ * @return 0, or the getaddrinfo() error code
+ */
+int resolveCached(t_addr_cache *cache, const char *host, const char *port, int family, int socktype)
+{
+	int64_t now = monotonicMs();
+
+	if (cache->list != NULL && now < cache->expires && cache->family == family &&
+		cache->socktype == socktype && strcmp(cache->host, host) == 0 && strcmp(cache->port, port) == 0)
+		return (0);
+	releaseAddrCache(cache);
+
+	struct addrinfo hints = {0};
+	hints.ai_family = family;
+	hints.ai_socktype = socktype;
+	int rv = getaddrinfo(host, port, &hints, &cache->list);
+	if (rv != 0)
+	{
+		cache->list = NULL;
+		return (rv);
+	}
+	snprintf(cache->host, sizeof(cache->host), "%s", host);
+	snprintf(cache->port, sizeof(cache->port), "%s", port);
+	cache->family = family;
+	cache->socktype = socktype;
+	cache->expires = now + ADDR_CACHE_TTL_MS;
+
+	// Split by family, then interleave
+	const struct addrinfo *preferred[MAX_CANDIDATES], *other[MAX_CANDIDATES];
+	int preferredCount = 0, otherCount = 0;
+	for (const struct addrinfo *p = cache->list; p != NULL; p = p->ai_next)
+	{
+		if (p->ai_family == cache->list->ai_family && preferredCount < MAX_CANDIDATES)
+			preferred[preferredCount++] = p;
+		else if (p->ai_family != cache->list->ai_family && otherCount < MAX_CANDIDATES)
+			other[otherCount++] = p;
+	}
+	cache->count = 0;
+	for (int i = 0; cache->count < MAX_CANDIDATES && (i < preferredCount || i < otherCount); i++)
+	{
+		if (i < preferredCount)
+			cache->order[cache->count++] = preferred[i];
+		if (i < otherCount && cache->count < MAX_CANDIDATES)
+			cache->order[cache->count++] = other[i];
+	}
+	return (0);
+}
+
+/**
+ * @brief Connect to the cached addresses with staggered, racing attempts.
+ *
+ * The next address gets a non-blocking connect every CONNECT_STAGGER_MS
+ * while the earlier ones are still pending, or as soon as one fails; the
+ * first to complete wins and the others are closed. The winner is tried
+ * first on the next call. The returned socket is blocking again.
+ *
+ * @return the socket, with `*used` set to its address, or -1 with errno
+ * set when every address failed (the cache is then dropped)
+ */
+int connectRace(t_addr_cache *cache, const struct addrinfo **used)
+{
+	struct pollfd pfds[MAX_CANDIDATES];
+	int owner[MAX_CANDIDATES]; // Candidate index of each pending socket
+	int pending = 0, next = 0, winner = -1, fd = -1, lastError = ECONNREFUSED;
+	int64_t nextStart = monotonicMs();
+
+	while (winner == -1 && (pending > 0 || next < cache->count))
+	{
+		// Start the next address when its turn came or nothing is in flight
+		int64_t now = monotonicMs();
+		if (next < cache->count && (pending == 0 || now >= nextStart))
+		{
+			const struct addrinfo *ai = cache->order[next];
+			int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (s == -1 || fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK) == -1)
+				lastError = errno;
+			else if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+			{
+				winner = next;
+				fd = s;
+			}
+			else if (errno == EINPROGRESS)
+			{
+				pfds[pending] = (struct pollfd){.fd = s, .events = POLLOUT};
+				owner[pending++] = next;
+				nextStart = now + CONNECT_STAGGER_MS;
+				s = -1;
+			}
+			else
+				lastError = errno;
+			if (s != -1 && winner == -1)
+				close(s);
+			next++;
+			continue;
+		}
+
+		int timeout = next < cache->count ? (int)(nextStart - now) : -1;
+		int ready = poll(pfds, pending, timeout);
+		if (ready == -1 && errno != EINTR)
+		{
+			lastError = errno;
+			break;
+		}
+		for (int i = 0; ready > 0 && i < pending; i++)
+		{
+			if (pfds[i].revents == 0)
+				continue;
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+				err = errno;
+			if (err == 0)
+			{
+				winner = owner[i];
+				fd = pfds[i].fd;
+				pfds[i] = pfds[--pending];
+				break;
+			}
+			// A failed attempt hands over to the next address right away
+			lastError = err;
+			close(pfds[i].fd);
+			pfds[i] = pfds[--pending];
+			owner[i] = owner[pending];
+			nextStart = monotonicMs();
+			i--;
+		}
+	}
+	for (int i = 0; i < pending; i++)
+		close(pfds[i].fd);
+
+	if (winner == -1)
+	{
+		releaseAddrCache(cache);
+		errno = lastError;
+		return (-1);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+	*used = cache->order[winner];
+	memmove(&cache->order[1], &cache->order[0], winner * sizeof(cache->order[0]));
+	cache->order[0] = *used;
+	return (fd);
+}
+
+/**
+ * @brief Read until the null terminator or the end of the stream.
+ *
+ * Each read takes up to RECV_SIZE bytes; `out`, when given, gets them in
+ * one write, without the terminator.
+ *
+ * @return the number of bytes read, or -1 on error
+ */
+long long receiveMessage(int sockFd, char *buf, FILE *out)
+{
+	long long total = 0;
+
+	while (true)
+	{
+		ssize_t rc = recv(sockFd, buf, RECV_SIZE, 0);
+		if (rc == -1 && errno == EINTR)
+			continue;
+		if (rc == -1)
+			return (-1);
+		if (rc == 0)
+			return (total);
+		char *end = memchr(buf, '\0', rc);
+		size_t len = end ? (size_t)(end - buf) : (size_t)rc;
+		if (out != NULL && len > 0)
+			fwrite(buf, 1, len, out);
+		total += len;
+		if (end != NULL)
+			return (total);
+	}
+}
+
+/**
+ * @brief Benchmark thread: opens, drains and closes connections until
+ * the shared count runs out.
+ */
+void *benchLoop(void *arg)
+{
+	t_bench *bench = arg;
+	char *buf = malloc(RECV_SIZE);
+
+	if (buf == NULL)
+	{
+		perror("client: benchLoop: malloc()");
+		return (NULL);
+	}
+	while (atomic_fetch_sub(&remaining, 1) > 0)
+	{
+		uint64_t start = nowNs();
+		const struct addrinfo *used;
+		int rv = resolveCached(&bench->cache, bench->hostname, bench->port, AF_UNSPEC, SOCK_STREAM);
+		if (rv != 0)
+		{
+			fprintf(stderr, "client: benchLoop: getaddrinfo(): %s\n", gai_strerror(rv));
+			bench->failed++;
+			continue;
+		}
+		int sockFd = connectRace(&bench->cache, &used);
+		if (sockFd == -1)
+		{
+			perror("client: benchLoop: connect()");
+			bench->failed++;
+			continue;
+		}
+		uint64_t connected = nowNs();
+		histAdd(&bench->connect, connected - start);
+
+		long long bytes = receiveMessage(sockFd, buf, NULL);
+		uint64_t elapsed = nowNs() - connected;
+		close(sockFd);
+		if (bytes == -1)
+		{
+			perror("client: benchLoop: recv()");
+			bench->failed++;
+			continue;
+		}
+		bench->bytes += bytes;
+		histAdd(&bench->throughput, elapsed ? bytes * 1000000000ULL / elapsed : 0);
+	}
+	releaseAddrCache(&bench->cache);
+	free(buf);
+	return (NULL);
+}
+
+/**
+ * @brief Run the benchmark and print its report.
+ */
+int runBenchmark(const char *hostname, const char *port, long connections, int concurrency)
+{
+	t_bench *benches = calloc(concurrency, sizeof(t_bench));
+	t_bench total = {0};
+
+	if (benches == NULL)
+	{
+		perror("client: runBenchmark: calloc()");
+		return (EXIT_FAILURE);
+	}
+	atomic_store(&remaining, connections);
+	uint64_t start = nowNs();
+	int started = 0;
+	for (; started < concurrency; started++)
+	{
+		benches[started].hostname = hostname;
+		benches[started].port = port;
+		if ((errno = pthread_create(&benches[started].thread, NULL, benchLoop, &benches[started])) != 0)
+		{
+			perror("client: pthread_create()");
+			break;
+		}
+	}
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(benches[i].thread, NULL);
+		histMerge(&total.connect, &benches[i].connect);
+		histMerge(&total.throughput, &benches[i].throughput);
+		total.bytes += benches[i].bytes;
+		total.failed += benches[i].failed;
+	}
+	double elapsed = (nowNs() - start) / 1e9;
+	free(benches);
+
+	printf("client: %lu connections (%lu failed) in %.2f s with %d threads: %.0f conn/s, %.2f MB/s\n",
+		   total.throughput.total, total.failed, elapsed, started,
+		   total.throughput.total / elapsed, total.bytes / elapsed / 1e6);
+	if (total.connect.total > 0)
+		printHistogram("connect latency", &total.connect, 1e3, "us");
+	if (total.throughput.total > 0)
+		printHistogram("transfer throughput", &total.throughput, 1e6, "MB/s");
+	return (total.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
 /**
  * @brief Main entry point. Connects to TCP server and prints received message.
  */
-int main(int argc, char const *argv[])
+int main(int argc, char *const argv[])
 {
-	struct addrinfo hints, *theirAddr;
+	t_addr_cache cache = {0};
 	const char *hostname, *port;
+	bool benchmark = false;
+	long connections = DEFAULT_CONNECTIONS;
+	int concurrency = 1, opt;
 
-	// Parse arguments: hostname required, PORT optional
-	if (argc < 2 or argc > 3)
+	// Parse arguments: [-b [-n CONNECTIONS] [-c CONCURRENCY]] hostname [PORT]
+	while ((opt = getopt(argc, argv, "bn:c:")) != -1)
 	{
-		fprintf(stderr, "Usage: client hostname [PORT]\n");
+		if (opt == 'b')
+			benchmark = true;
+		else if (opt == 'n' && (connections = atol(optarg)) >= 1)
+			continue;
+		else if (opt == 'c' && (concurrency = atoi(optarg)) >= 1 && concurrency <= MAX_CONCURRENCY)
+			continue;
+		else
+		{
+			fprintf(stderr, USAGE);
+			return (EXIT_FAILURE);
+		}
+	}
+	if (argc - optind < 1 or argc - optind > 2)
+	{
+		fprintf(stderr, USAGE);
 		return (EXIT_FAILURE);
 	}
-	hostname = argv[1];
-	if (argc == 3)
-		port = argv[2];
+	hostname = argv[optind];
+	if (argc - optind == 2)
+		port = argv[optind + 1];
 	else
 		port = PORT;
 
 	setbuf(stdout, NULL); // Disable buffering for stdout
 	setbuf(stderr, NULL); // Disable buffering for stderr
 
-	// Setup TCP socket hints
-	hints = (struct addrinfo){0};
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-
 	// Resolve server address
 	int rv;
-	if ((rv = getaddrinfo(hostname, port, &hints, &theirAddr)) != 0)
+	if ((rv = resolveCached(&cache, hostname, port, AF_UNSPEC, SOCK_STREAM)) != 0)
 	{
 		fprintf(stderr, "client: getaddrinfo(): %s\n", gai_strerror(rv));
 		return (EXIT_FAILURE);
 	}
 
-	// Create and connect TCP socket
-	struct addrinfo *p;
-	char theirIP[INET6_ADDRSTRLEN];
-	int sockFd;
-	for (p = theirAddr; p != NULL; p = p->ai_next)
+	// Every connection of the benchmark is timed, so no probe connection first
+	if (benchmark)
 	{
-		// Create socket
-		if ((sockFd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
-		{
-			perror("client: socket()");
-			continue;
-		}
-
-		// Get server IP address for debugging
-		// inet_ntop(p->ai_family, getinaddr((struct sockaddr *)p->ai_addr), theirIP, sizeof(theirIP));
-		// printf("client: attempting connection to %s...\n", theirIP);
-
-		// Connect to server
-		if (connect(sockFd, p->ai_addr, p->ai_addrlen) == -1)
-		{
-			// perror("client: connect()");
-			close(sockFd);
-			continue;
-		}
-
-		break;
+		releaseAddrCache(&cache);
+		printf("client: benchmarking %ld connections, %d at a time\n", connections, concurrency);
+		return (runBenchmark(hostname, port, connections, concurrency));
 	}
 
+	// Connect to the address that answers first
+	const struct addrinfo *p;
+	char theirIP[INET6_ADDRSTRLEN];
+	int sockFd = connectRace(&cache, &p);
+
 	// Check if we successfully connected
-	if (p == NULL)
+	if (sockFd == -1)
 	{
+		perror("client: connect()");
 		fprintf(stderr, "client: failed to connect\n");
 		return (EXIT_FAILURE);
 	}
@@ -105,33 +576,24 @@ int main(int argc, char const *argv[])
 	printf("client: connected to %s...\n", theirIP);
 
 	// No longer needed
-	freeaddrinfo(theirAddr);
+	releaseAddrCache(&cache);
 
 	// Receive and print message from server
-	char buf[MAXDSIZE];
-	printf("client: message received: \"");
-	int rc, done = false;
-	// Read until null terminator or error
-	while (!done)
+	char *buf = malloc(RECV_SIZE);
+	if (buf == NULL)
 	{
-		rc = recv(sockFd, buf, MAXDSIZE, 0);
-		if (rc <= 0)
-			break;
-		for (int i = 0; i < rc; ++i)
-		{
-			if (buf[i] == '\0')
-			{
-				done = true;
-				break;
-			}
-			putchar(buf[i]);
-		}
+		perror("client: malloc()");
+		close(sockFd);
+		return (EXIT_FAILURE);
 	}
+	printf("client: message received: \"");
+	long long rc = receiveMessage(sockFd, buf, stdout);
 	printf("\"\n");
 
 	if (rc == -1)
 		perror("client: recv()");
 
+	free(buf);
 	close(sockFd);
 	return (EXIT_SUCCESS);
 }
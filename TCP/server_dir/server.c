@@ -3,11 +3,26 @@
  * @file server.c
  * @brief TCP server: listens for connections and sends a message to each client.
  *
- * Usage: server [MSG] [PORT]
+ * Usage: server [-m fork|prefork|thread|epoll] [-w WORKERS] [-r] [-s BYTES] [MSG] [PORT]
+ *        server [-m fork|prefork|thread|epoll] [-w WORKERS] [-r] [-s BYTES] -f FILE [PORT]
+ *   - -m picks how connections are served: fork (default) forks a child per
+ *     connection, prefork starts WORKERS processes and thread WORKERS
+ *     threads up front, each accepting and serving connections in a loop,
+ *     and epoll serves every connection from one non-blocking event loop.
+ *   - -w sets the number of workers (default: one per online CPU).
+ *   - -r gives every worker its own SO_REUSEPORT listener, so the kernel
+ *     spreads connections across them, instead of all of them accepting
+ *     on one shared socket.
+ *   - -s sets the send buffer of client sockets (default: kernel
+ *     autotuning), bounding the kernel memory a slow client holds.
+ *   - -f sends the contents of FILE instead of MSG, with sendfile() from
+ *     a descriptor opened at startup; the file is reopened when it changes.
  *   - If MSG is omitted, uses default message.
  *   - If PORT is omitted, uses default 4242.
  */
 
+#define _GNU_SOURCE // accept4()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,13 +31,80 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <signal.h>
 #include <iso646.h>
 
 #define DEFAULT_PORT "4242"
 #define DEFAULT_MSG "Hello from server!"
-#define BACKLOG 5
+#define BACKLOG SOMAXCONN // Deep enough for bursts of connections
+#define MAX_WORKERS 1024
+#define MAX_EVENTS 256
+#define MAX_CONNS 1048576 // Upper bound for the fd-indexed connection table
+#define USAGE                                                              \
+	"Usage: server [-m fork|prefork|thread|epoll] [-w WORKERS] [-r] [-s BYTES] [MSG] [PORT]\n" \
+	"       server [-m fork|prefork|thread|epoll] [-w WORKERS] [-r] [-s BYTES] -f FILE [PORT]\n"
+
+/**
+ * @brief How accepted connections are served.
+ */
+typedef enum e_mode
+{
+	MODE_FORK,	  // One child process per connection
+	MODE_PREFORK, // Worker processes forked at startup
+	MODE_THREAD,  // Worker threads started at startup
+	MODE_EPOLL	  // One non-blocking event loop
+} t_mode;
+
+/**
+ * @brief A file served as the payload (-f), shared by the connections sending it.
+ *
+ * Replaced when the file changes on disk; connections still sending the
+ * old version keep it open through their reference.
+ */
+typedef struct s_payload
+{
+	atomic_int refs;
+	int fd;
+	struct stat st; // Identity, size and mtime of the file when opened
+} t_payload;
+
+/**
+ * @brief What a worker needs: the socket it accepts on and the message.
+ */
+typedef struct s_worker
+{
+	int sockFd;
+	const char *msg;
+	pthread_t thread;
+	pid_t pid;
+} t_worker;
+
+/**
+ * @brief A connection of the epoll mode, still being sent its payload.
+ *
+ * Indexed by fd, so a connection costs this and its socket, however slow
+ * the client reads.
+ */
+typedef struct s_conn
+{
+	off_t offset;		// Bytes sent so far
+	t_payload *payload; // NULL when sending MSG
+} t_conn;
+
+// File payload (-f); payload_lock guards `payload` in thread mode
+static int send_buffer = 0; // -s, 0 leaves the kernel default
+static const char *payload_path = NULL;
+static t_payload *payload = NULL;
+static pthread_mutex_t payload_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /**
@@ -69,35 +151,32 @@ void install_signals()
 }
 
 /**
- * @brief Main entry point. Listens for TCP connections and sends a message to each client.
+ * @brief Parse a serving mode given to -m.
+ * @return 0 on success, -1 if the name is unknown
  */
-int main(int argc, char const *argv[])
+int parse_mode(const char *name, t_mode *mode)
 {
-	struct addrinfo hints, *myAddr;
-	const char *port, *msg;
-
-	// Parse arguments: MSG and PORT optional
-	if (argc < 1 or argc > 3)
-	{
-		fprintf(stderr, "Usage: server [MSG] [PORT]\n");
-		return (EXIT_FAILURE);
-	}
-	if (argc > 1)
-	{
-		msg = argv[1];
-		if (argc == 3)
-			port = argv[2];
-		else
-			port = DEFAULT_PORT;
-	}
+	if (strcmp(name, "fork") == 0)
+		*mode = MODE_FORK;
+	else if (strcmp(name, "prefork") == 0)
+		*mode = MODE_PREFORK;
+	else if (strcmp(name, "thread") == 0)
+		*mode = MODE_THREAD;
+	else if (strcmp(name, "epoll") == 0)
+		*mode = MODE_EPOLL;
 	else
-	{
-		msg = DEFAULT_MSG;
-		port = DEFAULT_PORT;
-	}
+		return (-1);
+	return (0);
+}
 
-	setbuf(stdout, NULL); // Disable buffering for stdout
-	setbuf(stderr, NULL); // Disable buffering for stderr
+/**
+ * @brief Create a listening socket bound to `port`.
+ * @param reusePort Set SO_REUSEPORT, so that several sockets can bind the port
+ * @return the socket, -1 on failure
+ */
+int createListener(const char *port, bool reusePort)
+{
+	struct addrinfo hints, *myAddr;
 
 	// Setup TCP socket hints
 	hints = (struct addrinfo){0};
@@ -110,7 +189,7 @@ int main(int argc, char const *argv[])
 	if ((rv = getaddrinfo(NULL, port, &hints, &myAddr)) != 0)
 	{
 		fprintf(stderr, "server: getaddrinfo(): %s\n", gai_strerror(rv));
-		return (EXIT_FAILURE);
+		return (-1);
 	}
 
 	// Create and bind TCP socket
@@ -125,8 +204,9 @@ int main(int argc, char const *argv[])
 			continue;
 		}
 
-		// Set socket options to reuse address
-		if (setsockopt(sockFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+		// Set socket options to reuse address (and port, for per-worker listeners)
+		if (setsockopt(sockFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 or
+			(reusePort and setsockopt(sockFd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1))
 		{
 			perror("server: setsocketopt()");
 			close(sockFd);
@@ -151,7 +231,7 @@ int main(int argc, char const *argv[])
 	if (p == NULL)
 	{
 		fprintf(stderr, "server: failed to start!\n");
-		exit(EXIT_FAILURE);
+		return (-1);
 	}
 
 	// Start listening for incoming connections
@@ -159,44 +239,519 @@ int main(int argc, char const *argv[])
 	{
 		perror("server: listen()");
 		close(sockFd);
-		exit(EXIT_FAILURE);
+		return (-1);
+	}
+	return (sockFd);
+}
+
+/**
+ * @brief Accept one connection and, unless `quiet`, log where it comes from.
+ * @param flags accept4() flags, e.g. SOCK_NONBLOCK
+ * @param quiet no line per connection, and running out of fds is left to
+ *        the caller (epoll mode, whose single thread must not block on it)
+ * @return the connected socket, -1 on failure (errno set)
+ */
+int acceptClient(int sockFd, int flags, bool quiet)
+{
+	struct sockaddr_storage theirAddr;
+	socklen_t addrLen = sizeof(theirAddr);
+	char theirIP[INET6_ADDRSTRLEN];
+	int newSockFd;
+
+	if ((newSockFd = accept4(sockFd, (struct sockaddr *)&theirAddr, &addrLen, flags)) == -1)
+	{
+		if (errno != EINTR and errno != EAGAIN and errno != EWOULDBLOCK and
+			not(quiet and (errno == EMFILE or errno == ENFILE)))
+			perror("server: accept()");
+		return (-1);
+	}
+
+	if (send_buffer > 0 and setsockopt(newSockFd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(int)) == -1)
+		perror("server: setsockopt()");
+
+	if (quiet)
+		return (newSockFd);
+
+	// Get client IP address
+	inet_ntop(theirAddr.ss_family, getinaddr((struct sockaddr *)&theirAddr), theirIP, sizeof(theirIP));
+	printf("server: got connection from %s\n", theirIP);
+	return (newSockFd);
+}
+
+/**
+ * @brief Open payload_path as a payload.
+ * @return the payload with one reference, NULL on failure
+ */
+t_payload *openPayload(void)
+{
+	t_payload *p = malloc(sizeof(t_payload));
+
+	if (p == NULL)
+	{
+		perror("server: malloc()");
+		return (NULL);
+	}
+	if ((p->fd = open(payload_path, O_RDONLY | O_CLOEXEC)) == -1 or fstat(p->fd, &p->st) == -1)
+	{
+		perror("server: open()");
+		if (p->fd != -1)
+			close(p->fd);
+		free(p);
+		return (NULL);
+	}
+	atomic_init(&p->refs, 1);
+	return (p);
+}
+
+/**
+ * @brief Drop a reference on a payload; closes it on the last one.
+ */
+void releasePayload(t_payload *p)
+{
+	if (atomic_fetch_sub(&p->refs, 1) == 1)
+	{
+		close(p->fd);
+		free(p);
+	}
+}
+
+/**
+ * @brief Take a reference on the current payload, reopening the file first
+ * if it changed (other inode, size or mtime) since it was opened.
+ *
+ * One stat() per connection, so a replaced file is picked up by the next
+ * client. Replace files with rename() for clients never to see a file
+ * being written.
+ */
+t_payload *acquirePayload(void)
+{
+	struct stat st;
+	bool fresh = stat(payload_path, &st) == 0;
+
+	pthread_mutex_lock(&payload_lock);
+	if (fresh and (st.st_ino != payload->st.st_ino or st.st_dev != payload->st.st_dev or
+				   st.st_size != payload->st.st_size or
+				   st.st_mtim.tv_sec != payload->st.st_mtim.tv_sec or
+				   st.st_mtim.tv_nsec != payload->st.st_mtim.tv_nsec))
+	{
+		t_payload *p = openPayload();
+		if (p != NULL)
+		{
+			releasePayload(payload);
+			payload = p;
+			printf("server: reloaded %s (%lld bytes)\n", payload_path, (long long)p->st.st_size);
+		}
+	}
+	t_payload *p = payload;
+	atomic_fetch_add(&p->refs, 1);
+	pthread_mutex_unlock(&payload_lock);
+	return (p);
+}
+
+/**
+ * @brief Send the rest of the message, or of the payload file when `p` is
+ * set, from `*offset` on.
+ *
+ * The file goes from the page cache to the socket with sendfile(), never
+ * through a user space buffer; the explicit offset leaves the file
+ * position, shared by every worker, alone.
+ * @return 1 once everything is sent, 0 when a non-blocking socket is full,
+ * -1 on failure
+ */
+int sendRest(int sockFd, const char *msg, t_payload *p, off_t *offset)
+{
+	off_t size = p != NULL ? p->st.st_size : (off_t)strlen(msg);
+
+	while (*offset < size)
+	{
+		ssize_t sent;
+		if (p != NULL)
+			sent = sendfile(sockFd, p->fd, offset, size - *offset);
+		else if ((sent = send(sockFd, msg + *offset, size - *offset, MSG_NOSIGNAL)) > 0)
+			*offset += sent;
+		if (sent == -1 and errno == EINTR)
+			continue;
+		if (sent == -1 and (errno == EAGAIN or errno == EWOULDBLOCK))
+			return (0);
+		if (sent == -1)
+			perror(p != NULL ? "server: sendfile()" : "server: send()");
+		if (sent <= 0)
+			return (-1); // Error, or the file shrank
+	}
+	return (1);
+}
+
+/**
+ * @brief Send the message, or the payload file when `p` is set, to a client
+ * and close the connection.
+ */
+void serveClient(int newSockFd, const char *msg, t_payload *p)
+{
+	off_t offset = 0;
+
+	sendRest(newSockFd, msg, p, &offset);
+	close(newSockFd);
+}
+
+/**
+ * @brief Worker loop of the prefork and thread modes: accept, serve, repeat.
+ *
+ * Workers sharing one listener all block in accept() on it and the kernel
+ * hands each connection to one of them; with -r each worker has its own.
+ */
+void *workerLoop(void *arg)
+{
+	t_worker *worker = arg;
+
+	while (true)
+	{
+		int newSockFd = acceptClient(worker->sockFd, 0, false);
+		if (newSockFd == -1)
+			continue;
+		t_payload *p = payload_path != NULL ? acquirePayload() : NULL;
+		serveClient(newSockFd, worker->msg, p);
+		if (p != NULL)
+			releasePayload(p);
+	}
+	return (NULL);
+}
+
+/**
+ * @brief Fork a worker process running workerLoop().
+ *
+ * The worker dies with the parent, so stopping the server stops the pool.
+ * @return the worker's pid, -1 on failure
+ */
+pid_t forkWorker(t_worker *worker, t_worker *workers, int count)
+{
+	pid_t parent = getpid();
+	pid_t pid = fork();
+
+	if (pid == -1)
+	{
+		perror("server: fork()");
+		return (-1);
+	}
+	if (pid == 0)
+	{
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		if (getppid() != parent)
+			exit(EXIT_FAILURE);
+		// Keep only this worker's listener
+		for (int w = 0; w < count; w++)
+		{
+			if (workers[w].sockFd != worker->sockFd)
+				close(workers[w].sockFd);
+		}
+		workerLoop(worker);
+		exit(EXIT_SUCCESS);
 	}
+	return (pid);
+}
 
+/**
+ * @brief Fork mode: the original accept loop, one child per connection.
+ */
+void runFork(int sockFd, const char *msg)
+{
 	// Install signal handler for child cleanup
 	install_signals();
 
 	printf("server: waiting for connections...\n");
 
 	// Accept and handle client connections
-	struct sockaddr_storage theirAddr;
-	socklen_t addrLen = sizeof(theirAddr);
 	int newSockFd;
-	char theirIP[INET6_ADDRSTRLEN];
 	while (true)
 	{
 		// Accept a new connection
-		if ((newSockFd = accept(sockFd, (struct sockaddr *)&theirAddr, &addrLen)) == -1)
-		{
-			perror("server: accept()");
+		if ((newSockFd = acceptClient(sockFd, 0, false)) == -1)
 			continue;
-		}
 
-		// Get client IP address
-		inet_ntop(theirAddr.ss_family, getinaddr((struct sockaddr *)&theirAddr), theirIP, sizeof(theirIP));
-		printf("server: got connection from %s\n", theirIP);
-
-		// Fork to handle client
+		// Fork to handle client; the parent keeps the payload up to date
+		t_payload *p = payload_path != NULL ? acquirePayload() : NULL;
 		if (!fork())
 		{
 			close(sockFd);
-			if (send(newSockFd, msg, strlen(msg), 0) == -1)
-				perror("server: send()");
-			close(newSockFd);
+			serveClient(newSockFd, msg, p);
 			exit(EXIT_SUCCESS);
 		}
 		close(newSockFd);
+		if (p != NULL)
+			releasePayload(p);
+	}
+}
+
+/**
+ * @brief Close an epoll mode connection, sent in full or failed.
+ *
+ * Closing the socket also removes it from the epoll set.
+ */
+void closeConn(t_conn *conns, int fd)
+{
+	if (conns[fd].payload != NULL)
+		releasePayload(conns[fd].payload);
+	conns[fd].payload = NULL;
+	close(fd);
+}
+
+/**
+ * @brief Drop the connection at the head of the backlog when the process
+ * is out of file descriptors.
+ *
+ * Left there, the level-triggered listener would be reported again at
+ * once and the loop would spin: the reserve fd is closed to make room for
+ * accepting it, the connection is closed and the reserve taken back.
+ * @return true if a connection was shed
+ */
+bool shedConnection(int sockFd, int *reserveFd)
+{
+	if (*reserveFd == -1)
+		return (false);
+	close(*reserveFd);
+	int fd = accept(sockFd, NULL, NULL);
+	if (fd != -1)
+		close(fd);
+	*reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return (fd != -1);
+}
+
+/**
+ * @brief Epoll mode: one process, no fork, no thread per connection.
+ *
+ * Every accepted socket is non-blocking and gets as much of the payload as
+ * it takes right away. Only connections with bytes left are watched, for
+ * EPOLLOUT, and each writable event resumes at their offset; a connection
+ * is closed as soon as its payload is fully sent. Connections are not
+ * logged one by one, and those arriving when the fds run out are shed.
+ */
+void runEpoll(int sockFd, const char *msg)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct rlimit rl;
+
+	// Every client holds an fd: allow as many as the hard limit does
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 and rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	int conns_max = MAX_CONNS;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 and rl.rlim_cur < (rlim_t)MAX_CONNS)
+		conns_max = rl.rlim_cur;
+
+	t_conn *conns = calloc(conns_max, sizeof(t_conn));
+	int reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	bool shedding = false;
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	int flags = fcntl(sockFd, F_GETFL);
+	ev = (struct epoll_event){.events = EPOLLIN, .data.fd = sockFd};
+	if (conns == NULL or epollFd == -1 or flags == -1 or fcntl(sockFd, F_SETFL, flags | O_NONBLOCK) == -1 or
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, sockFd, &ev) == -1)
+	{
+		perror("server: runEpoll()");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("server: waiting for connections (epoll, up to %d)...\n", conns_max);
+
+	while (true)
+	{
+		int ready = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+		if (ready == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("server: epoll_wait()");
+			exit(EXIT_FAILURE);
+		}
+		for (int e = 0; e < ready; e++)
+		{
+			int fd = events[e].data.fd;
+
+			if (fd != sockFd)
+			{
+				if (sendRest(fd, msg, conns[fd].payload, &conns[fd].offset) != 0)
+					closeConn(conns, fd);
+				continue;
+			}
+
+			// Drain the backlog; a new connection starts sending right away
+			while (true)
+			{
+				fd = acceptClient(sockFd, SOCK_NONBLOCK | SOCK_CLOEXEC, true);
+				if (fd == -1 and (errno == EMFILE or errno == ENFILE) and shedConnection(sockFd, &reserveFd))
+				{
+					if (not shedding)
+						fprintf(stderr, "server: out of file descriptors, rejecting connections\n");
+					shedding = true;
+					continue;
+				}
+				if (fd == -1)
+					break;
+				shedding = false;
+				if (fd >= conns_max)
+				{
+					close(fd);
+					continue;
+				}
+				conns[fd] = (t_conn){.payload = payload_path != NULL ? acquirePayload() : NULL};
+				int rv = sendRest(fd, msg, conns[fd].payload, &conns[fd].offset);
+				ev = (struct epoll_event){.events = EPOLLOUT, .data.fd = fd};
+				if (rv == 0 and epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+				{
+					perror("server: epoll_ctl()");
+					rv = -1;
+				}
+				if (rv != 0)
+					closeConn(conns, fd);
+			}
+		}
 	}
+}
 
-	close(sockFd);
+/**
+ * @brief Prefork mode: start the worker processes and replace any that dies.
+ */
+void runPrefork(t_worker *workers, int count)
+{
+	for (int w = 0; w < count; w++)
+	{
+		if ((workers[w].pid = forkWorker(&workers[w], workers, count)) == -1)
+			exit(EXIT_FAILURE);
+	}
+	printf("server: waiting for connections (%d worker processes)...\n", count);
+
+	while (true)
+	{
+		pid_t pid = wait(NULL);
+		if (pid == -1)
+		{
+			if (errno != EINTR)
+			{
+				perror("server: wait()");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+		for (int w = 0; w < count; w++)
+		{
+			if (workers[w].pid != pid)
+				continue;
+			fprintf(stderr, "server: worker %d exited, restarting it\n", w);
+			sleep(1); // Do not spin if workers die right away
+			workers[w].pid = forkWorker(&workers[w], workers, count);
+		}
+	}
+}
+
+/**
+ * @brief Thread mode: start the worker threads and wait for them.
+ */
+void runThreads(t_worker *workers, int count)
+{
+	for (int w = 0; w < count; w++)
+	{
+		if ((errno = pthread_create(&workers[w].thread, NULL, workerLoop, &workers[w])) != 0)
+		{
+			perror("server: pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+	}
+	printf("server: waiting for connections (%d worker threads)...\n", count);
+
+	for (int w = 0; w < count; w++)
+		pthread_join(workers[w].thread, NULL);
+}
+
+/**
+ * @brief Main entry point. Listens for TCP connections and sends a message to each client.
+ */
+int main(int argc, char *const argv[])
+{
+	const char *port = DEFAULT_PORT, *msg = DEFAULT_MSG;
+	t_mode mode = MODE_FORK;
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	bool reusePort = false;
+	int opt;
+
+	// Parse arguments: [-m MODE] [-w WORKERS] [-r] [-s BYTES] [-f FILE], then MSG (unless -f) and PORT optional
+	while ((opt = getopt(argc, argv, "m:w:rs:f:")) != -1)
+	{
+		if (opt == 's' and (send_buffer = atoi(optarg)) > 0)
+			continue;
+		if (opt == 'f')
+		{
+			payload_path = optarg;
+			continue;
+		}
+		if (opt == 'm' and parse_mode(optarg, &mode) == 0)
+			continue;
+		if (opt == 'w' and (count = atol(optarg)) >= 1 and count <= MAX_WORKERS)
+			continue;
+		if (opt == 'r')
+		{
+			reusePort = true;
+			continue;
+		}
+		fprintf(stderr, USAGE);
+		return (EXIT_FAILURE);
+	}
+	if (argc - optind > (payload_path != NULL ? 1 : 2))
+	{
+		fprintf(stderr, USAGE);
+		return (EXIT_FAILURE);
+	}
+	if (payload_path == NULL and optind < argc)
+		msg = argv[optind++];
+	if (optind < argc)
+		port = argv[optind];
+	if (count < 1)
+		count = 1;
+	else if (count > MAX_WORKERS)
+		count = MAX_WORKERS;
+
+	setbuf(stdout, NULL); // Disable buffering for stdout
+	setbuf(stderr, NULL); // Disable buffering for stderr
+
+	// sendfile() has no MSG_NOSIGNAL: a client closing early must not kill us
+	signal(SIGPIPE, SIG_IGN);
+
+	if (payload_path != NULL)
+	{
+		if ((payload = openPayload()) == NULL)
+			exit(EXIT_FAILURE);
+		printf("server: serving %s (%lld bytes)\n", payload_path, (long long)payload->st.st_size);
+	}
+
+	if (mode == MODE_FORK or mode == MODE_EPOLL)
+	{
+		int sockFd = createListener(port, false);
+		if (sockFd == -1)
+			exit(EXIT_FAILURE);
+		if (mode == MODE_EPOLL)
+			runEpoll(sockFd, msg);
+		else
+			runFork(sockFd, msg);
+		close(sockFd);
+		return (EXIT_SUCCESS);
+	}
+
+	// One listener shared by every worker, or one each with -r
+	t_worker workers[MAX_WORKERS];
+	for (int w = 0; w < count; w++)
+	{
+		workers[w] = (t_worker){.msg = msg};
+		if (w == 0 or reusePort)
+			workers[w].sockFd = createListener(port, reusePort);
+		else
+			workers[w].sockFd = workers[0].sockFd;
+		if (workers[w].sockFd == -1)
+			exit(EXIT_FAILURE);
+	}
+
+	if (mode == MODE_PREFORK)
+		runPrefork(workers, count);
+	else
+		runThreads(workers, count);
 	return (EXIT_SUCCESS);
 }
@@ -3,21 +3,90 @@
  * @file listener.c
  * @brief UDP server: receives datagrams and prints message up to delimiter '\r'.
  *
- * Usage: listener [PORT]
+ * Usage: listener [-b | -R [-l LOSS]] [-n BATCH] [-q] [-i SECONDS] [PORT]
+ *   - -b receives in batches: one recvmmsg() fills up to BATCH MTU-sized
+ *     buffers (default: 64), output is fully buffered, and packet and byte
+ *     rates are printed to stderr every SECONDS (-i, default: 1), with the
+ *     datagrams the kernel dropped because the socket buffer was full.
+ *   - -R receives reliable transfers from `talker -R`, in batches as with
+ *     -b: datagrams are put back in order and acknowledged, and only the
+ *     data goes to stdout (status lines go to stderr).
+ *   - -l drops a LOSS fraction (0 to 1) of the acks sent with -R, to
+ *     simulate a lossy link.
+ *   - -q discards the payloads instead of printing them.
  *   - If PORT is omitted, uses default 4242.
  */
 
+#define _GNU_SOURCE // recvmmsg()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <iso646.h>
 
 #define DEFAULT_PORT "4242"
 #define MAXDSIZE 10
+#define MTU_SIZE 1500			 // Largest datagram kept whole by -b, larger ones are truncated
+#define DEFAULT_BATCH 64
+#define MAX_BATCH 1024
+#define RCVBUF_SIZE (32 << 20)	 // Absorbs bursts while a batch is written out
+#define OUT_BUFFER_SIZE (1 << 20) // stdout buffer with -b
+#define IDLE_TIMEOUT_MS 100		 // Receive timeout, so stats and output flow when idle
+#define USAGE "Usage: listener [-b | -R [-l LOSS]] [-n BATCH] [-q] [-i SECONDS] [PORT]\n"
+
+// Reliable mode (-R), must match talker.c
+#define REL_HEADER_SIZE 16 // type, flags, 2 unused, session, sequence, timestamp (us)
+#define REL_ACK_SIZE 20	   // type, SACK blocks, 2 unused, session, cumulative ack, echoed timestamp, window
+#define REL_DATA 1
+#define REL_ACK 2
+#define REL_FIN 0x01	 // Data flag: end of the transfer, carries no payload
+#define REL_MAX_SACKS 4	 // [start, end) pairs after the ack header
+#define REL_WINDOW 4096	 // Reorder window, datagrams
+#define REL_ACK_EVERY 4	 // Datagrams per ack at most, so that one lost ack costs little
+
+/**
+ * @brief Counters of the batched receive loop.
+ */
+typedef struct s_stats
+{
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long truncated; // Datagrams longer than MTU_SIZE
+	uint32_t dropped;			  // Kernel drop counter of the socket (SO_RXQ_OVFL)
+} t_stats;
+
+/**
+ * @brief Receiver state of reliable transfers (-R), one at a time.
+ */
+typedef struct s_transfer
+{
+	bool active;	  // Under way; false once the FIN was delivered
+	uint32_t session; // Of the current or last transfer
+	uint32_t next;	  // Next datagram to deliver
+	uint32_t highest; // One past the highest datagram received
+	uint32_t latest;  // Datagram received last, first SACK block
+	uint32_t echo;	  // Its timestamp, echoed for the sender's RTT
+	bool ackDue;
+	int unacked; // Datagrams since the last ack
+	char *bufs; // Reorder buffer: REL_WINDOW payloads, by sequence % REL_WINDOW
+	uint16_t lens[REL_WINDOW];
+	bool fins[REL_WINDOW];
+	bool have[REL_WINDOW];
+	struct sockaddr_storage peer;
+	socklen_t peerLen;
+	double loss; // Drop injector (-l)
+	uint64_t rng;
+	uint64_t start; // nowNs() of the first datagram, 0 before any transfer
+	unsigned long long bytes, packets, duplicates, reordered;
+} t_transfer;
 
 /**
  * @brief Extracts pointer to IPv4 or IPv6 address from sockaddr.
@@ -29,27 +98,381 @@ void *getinaddr(struct sockaddr *sa)
 	return (&(((struct sockaddr_in6 *)sa)->sin6_addr));
 }
 
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/**
+ * @brief Print the rates since the last report to stderr.
+ */
+void reportStats(const t_stats *total, const t_stats *last, double seconds)
+{
+	unsigned long long packets = total->packets - last->packets;
+	unsigned long long bytes = total->bytes - last->bytes;
+
+	fprintf(stderr, "listener: %.0f pkt/s, %.2f MB/s, %llu packets, %llu bytes, %u dropped, %llu truncated\n",
+			packets / seconds, bytes / seconds / 1e6, total->packets, total->bytes,
+			total->dropped, total->truncated);
+}
+
+/**
+ * @brief Whether sequence number `a` comes before `b`, across wrap-around.
+ */
+bool seqBefore(uint32_t a, uint32_t b)
+{
+	return ((int32_t)(a - b) < 0);
+}
+
+/**
+ * @brief Store a 32-bit value in network byte order.
+ */
+void putU32(char *p, uint32_t value)
+{
+	value = htonl(value);
+	memcpy(p, &value, sizeof(value));
+}
+
+/**
+ * @brief Read a 32-bit value in network byte order.
+ */
+uint32_t getU32(const char *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return (ntohl(value));
+}
+
+/**
+ * @brief Drop injector: true for a `loss` fraction of the calls (xorshift64*).
+ */
+bool injectDrop(double loss, uint64_t *rng)
+{
+	if (loss <= 0)
+		return (false);
+	*rng ^= *rng >> 12;
+	*rng ^= *rng << 25;
+	*rng ^= *rng >> 27;
+	return ((*rng * 0x2545F4914F6CDD1DULL >> 11) * (1.0 / 9007199254740992.0) < loss);
+}
+
+/**
+ * @brief Acknowledge what arrived of the current (or just finished) transfer.
+ *
+ * The first SACK block holds the datagram that arrived last, the others
+ * are the lowest ranges received above the cumulative ack.
+ */
+void relSendAck(int sockFd, t_transfer *t)
+{
+	char ack[REL_ACK_SIZE + REL_MAX_SACKS * 8];
+	uint32_t blocks[REL_MAX_SACKS][2];
+	int count = 0;
+
+	t->ackDue = false;
+	t->unacked = 0;
+	if (t->active && seqBefore(t->next, t->latest) && t->have[t->latest % REL_WINDOW])
+	{
+		uint32_t start = t->latest, end = t->latest + 1;
+		while (seqBefore(t->next, start) && t->have[(start - 1) % REL_WINDOW])
+			start--;
+		while (seqBefore(end, t->highest) && t->have[end % REL_WINDOW])
+			end++;
+		blocks[count][0] = start;
+		blocks[count++][1] = end;
+	}
+	for (uint32_t seq = t->next; t->active && count < REL_MAX_SACKS && seqBefore(seq, t->highest);)
+	{
+		if (!t->have[seq % REL_WINDOW])
+		{
+			seq++;
+			continue;
+		}
+		uint32_t start = seq;
+		while (seqBefore(seq, t->highest) && t->have[seq % REL_WINDOW])
+			seq++;
+		if (count == 0 || start != blocks[0][0])
+		{
+			blocks[count][0] = start;
+			blocks[count++][1] = seq;
+		}
+	}
+
+	ack[0] = REL_ACK;
+	ack[1] = count;
+	ack[2] = ack[3] = 0;
+	putU32(ack + 4, t->session);
+	putU32(ack + 8, t->next);
+	putU32(ack + 12, t->echo);
+	putU32(ack + 16, REL_WINDOW - (t->active ? t->highest - t->next : 0));
+	for (int i = 0; i < count; i++)
+	{
+		putU32(ack + REL_ACK_SIZE + i * 8, blocks[i][0]);
+		putU32(ack + REL_ACK_SIZE + i * 8 + 4, blocks[i][1]);
+	}
+	if (injectDrop(t->loss, &t->rng))
+		return;
+	if (sendto(sockFd, ack, REL_ACK_SIZE + count * 8, 0, (struct sockaddr *)&t->peer, t->peerLen) == -1)
+		perror("listener: sendto()");
+}
+
+/**
+ * @brief Write out one in-order datagram; the FIN ends the transfer.
+ */
+void relDeliver(t_transfer *t, const char *payload, size_t len, bool fin, bool quiet)
+{
+	if (!quiet)
+		fwrite(payload, 1, len, stdout);
+	t->bytes += len;
+	t->next++;
+	if (!fin)
+		return;
+
+	double elapsed = (nowNs() - t->start) / 1e9;
+	fflush(stdout);
+	fprintf(stderr, "listener: transfer complete, %llu bytes in %.2f s: %.2f Mbit/s, %llu datagrams, "
+					"%llu duplicates, %llu out of order\n",
+			t->bytes, elapsed, elapsed > 0 ? t->bytes * 8 / elapsed / 1e6 : 0.0, t->packets,
+			t->duplicates, t->reordered);
+	t->active = false;
+}
+
+/**
+ * @brief Handle one datagram of a reliable transfer (-R).
+ *
+ * A new session starts a new transfer. Datagrams are delivered in
+ * sequence order; those arriving early wait in a REL_WINDOW reorder
+ * buffer, and duplicates only get acknowledged again. Datagrams of the
+ * transfer that just finished are acknowledged right away, in case the
+ * last ack was lost.
+ */
+void relReceive(int sockFd, t_transfer *t, const char *dgram, size_t len,
+				const struct sockaddr_storage *from, socklen_t fromLen, bool quiet)
+{
+	if (len < REL_HEADER_SIZE || len > MTU_SIZE || dgram[0] != REL_DATA)
+		return;
+	uint32_t session = getU32(dgram + 4), seq = getU32(dgram + 8);
+	const char *payload = dgram + REL_HEADER_SIZE;
+	size_t payloadLen = len - REL_HEADER_SIZE;
+	bool fin = dgram[1] & REL_FIN;
+
+	if (t->start == 0 || session != t->session)
+	{
+		if (t->active)
+			fprintf(stderr, "listener: transfer abandoned after %llu bytes\n", t->bytes);
+		char theirIP[INET6_ADDRSTRLEN];
+		inet_ntop(from->ss_family, getinaddr((struct sockaddr *)from), theirIP, sizeof(theirIP));
+		fprintf(stderr, "listener: transfer from %s\n", theirIP);
+		memset(t->have, 0, sizeof(t->have));
+		t->session = session;
+		t->next = t->highest = 0;
+		t->bytes = t->packets = t->duplicates = t->reordered = 0;
+		t->start = nowNs();
+		t->active = true;
+	}
+	memcpy(&t->peer, from, fromLen);
+	t->peerLen = fromLen;
+	t->echo = getU32(dgram + 12);
+	t->latest = seq;
+	t->packets++;
+	if (!t->active || seqBefore(seq, t->next) || (seqBefore(seq, t->highest) && t->have[seq % REL_WINDOW]))
+	{
+		// Already delivered or buffered: the sender missed an ack
+		t->duplicates++;
+		relSendAck(sockFd, t);
+		return;
+	}
+	if (seq - t->next >= REL_WINDOW)
+		return;
+	t->ackDue = true;
+	t->unacked++;
+	if (seqBefore(t->highest, seq + 1))
+		t->highest = seq + 1;
+	if (seq != t->next)
+	{
+		t->reordered++;
+		memcpy(t->bufs + (size_t)(seq % REL_WINDOW) * MTU_SIZE, payload, payloadLen);
+		t->lens[seq % REL_WINDOW] = payloadLen;
+		t->fins[seq % REL_WINDOW] = fin;
+		t->have[seq % REL_WINDOW] = true;
+		return;
+	}
+	relDeliver(t, payload, payloadLen, fin, quiet);
+	while (t->active && t->have[t->next % REL_WINDOW])
+	{
+		uint32_t slot = t->next % REL_WINDOW;
+		t->have[slot] = false;
+		relDeliver(t, t->bufs + (size_t)slot * MTU_SIZE, t->lens[slot], t->fins[slot], quiet);
+	}
+}
+
+/**
+ * @brief Receive loop of -b: pulls up to `batch` datagrams per recvmmsg().
+ *
+ * Every slot has its own preallocated MTU-sized buffer, sender address and
+ * control buffer, which carries the socket's drop counter. Payloads go to
+ * the buffered stdout with the same message framing as the default loop,
+ * flushed when the socket goes idle. With `rel` (-R), datagrams go through
+ * the reliable transfer instead, acknowledged every REL_ACK_EVERY
+ * datagrams and at the end of each batch.
+ */
+int runBatch(int sockFd, int batch, bool quiet, int interval, t_transfer *rel)
+{
+	char (*bufs)[MTU_SIZE] = malloc(batch * sizeof(*bufs));
+	struct mmsghdr *msgs = calloc(batch, sizeof(*msgs));
+	struct iovec *iovs = calloc(batch, sizeof(*iovs));
+	struct sockaddr_storage *addrs = calloc(batch, sizeof(*addrs));
+	char (*ctrls)[CMSG_SPACE(sizeof(uint32_t))] = calloc(batch, sizeof(*ctrls));
+
+	if (bufs == NULL || msgs == NULL || iovs == NULL || addrs == NULL || ctrls == NULL)
+	{
+		perror("listener: runBatch: malloc()");
+		return (EXIT_FAILURE);
+	}
+	for (int i = 0; i < batch; i++)
+	{
+		iovs[i] = (struct iovec){.iov_base = bufs[i], .iov_len = MTU_SIZE};
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_control = ctrls[i];
+	}
+
+	// A large receive buffer (beyond rmem_max when allowed) and the drop counter
+	int size = RCVBUF_SIZE, on = 1;
+	if (setsockopt(sockFd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == -1)
+		setsockopt(sockFd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (setsockopt(sockFd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1)
+		perror("listener: runBatch: setsockopt(SO_RXQ_OVFL)");
+	struct timeval idle = {.tv_sec = 0, .tv_usec = IDLE_TIMEOUT_MS * 1000};
+	setsockopt(sockFd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+	// In -R mode stdout carries only the transferred data
+	fprintf(rel != NULL ? stderr : stdout, "listener: receiving in batches of %d...\n", batch);
+	fflush(stdout);
+	t_stats total = {0}, last = {0};
+	uint64_t lastReport = nowNs();
+	bool inMessage = false;
+	while (true)
+	{
+		for (int i = 0; i < batch; i++)
+		{
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrls[i]);
+		}
+		int count = recvmmsg(sockFd, msgs, batch, MSG_WAITFORONE, NULL);
+		if (count == -1 && errno != EAGAIN && errno != EINTR)
+		{
+			perror("listener: recvmmsg()");
+			return (EXIT_FAILURE);
+		}
+		if (count == -1)
+			fflush(stdout);
+
+		for (int i = 0; i < count; i++)
+		{
+			struct msghdr *hdr = &msgs[i].msg_hdr;
+			size_t len = msgs[i].msg_len;
+			total.packets++;
+			total.bytes += len;
+			if (hdr->msg_flags & MSG_TRUNC)
+				total.truncated++;
+			for (struct cmsghdr *c = CMSG_FIRSTHDR(hdr); c != NULL; c = CMSG_NXTHDR(hdr, c))
+				if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL)
+					memcpy(&total.dropped, CMSG_DATA(c), sizeof(total.dropped));
+			// A truncated datagram is not acked, the talker sends it again
+			if (rel != NULL && !(hdr->msg_flags & MSG_TRUNC))
+				relReceive(sockFd, rel, bufs[i], len, &addrs[i], hdr->msg_namelen, quiet);
+			if (rel != NULL && rel->unacked >= REL_ACK_EVERY)
+				relSendAck(sockFd, rel);
+			if (quiet || rel != NULL)
+				continue;
+
+			// Same framing as the default loop: a lone '\r' ends the message
+			if (len == 1 && bufs[i][0] == '\r')
+			{
+				if (inMessage)
+					fputc('\n', stdout);
+				inMessage = false;
+				continue;
+			}
+			if (!inMessage)
+			{
+				char theirIP[INET6_ADDRSTRLEN];
+				inet_ntop(addrs[i].ss_family, getinaddr((struct sockaddr *)&addrs[i]), theirIP, sizeof(theirIP));
+				printf("listener: got a message from %s:\n", theirIP);
+				inMessage = true;
+			}
+			fwrite(bufs[i], 1, len < MTU_SIZE ? len : MTU_SIZE, stdout);
+		}
+		if (rel != NULL && rel->ackDue)
+			relSendAck(sockFd, rel);
+
+		uint64_t now = nowNs();
+		if (now - lastReport >= interval * 1000000000ULL)
+		{
+			if (total.packets != last.packets || total.dropped != last.dropped)
+				reportStats(&total, &last, (now - lastReport) / 1e9);
+			last = total;
+			lastReport = now;
+		}
+	}
+}
+
 /**
  * @brief Main entry point. Receives UDP datagrams and prints message up to delimiter.
  */
-int main(int argc, char const *argv[])
+int main(int argc, char *const argv[])
 {
 	struct addrinfo hints, *myAddr;
 	const char *port;
+	bool batched = false, quiet = false, reliable = false;
+	int batch = DEFAULT_BATCH, interval = 1, opt;
+	double loss = 0;
 
-	// Parse arguments: PORT optional
-	if (argc < 1 or argc > 2)
+	// Parse arguments: [-b | -R [-l LOSS]] [-n BATCH] [-q] [-i SECONDS] [PORT]
+	while ((opt = getopt(argc, argv, "bRl:n:qi:")) != -1)
 	{
-		fprintf(stderr, "Usage: listener [PORT]\n");
+		if (opt == 'b')
+			batched = true;
+		else if (opt == 'R')
+			reliable = true;
+		else if (opt == 'l' && (loss = atof(optarg)) >= 0 && loss < 1)
+			continue;
+		else if (opt == 'q')
+			quiet = true;
+		else if (opt == 'n' && (batch = atoi(optarg)) >= 1 && batch <= MAX_BATCH)
+			continue;
+		else if (opt == 'i' && (interval = atoi(optarg)) >= 1)
+			continue;
+		else
+		{
+			fprintf(stderr, USAGE);
+			return (EXIT_FAILURE);
+		}
+	}
+	if (argc - optind > 1 or (batched and reliable) or (loss > 0 and !reliable))
+	{
+		fprintf(stderr, USAGE);
 		return (EXIT_FAILURE);
 	}
-	if (argc == 2)
-		port = argv[1];
+	if (argc - optind == 1)
+		port = argv[optind];
 	else
 		port = DEFAULT_PORT;
 
-	setbuf(stdout, NULL); // Disable buffering for stdout
-	setbuf(stderr, NULL); // Disable buffering for stderr
+	// Batches are written out through a large buffer instead
+	if (batched || reliable)
+		setvbuf(stdout, NULL, _IOFBF, OUT_BUFFER_SIZE);
+	else
+		setbuf(stdout, NULL); // Disable buffering for stdout
+	setbuf(stderr, NULL);	  // Disable buffering for stderr
 
 	// Setup UDP socket hints
 	hints = (struct addrinfo){0};
@@ -98,6 +521,27 @@ int main(int argc, char const *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (batched)
+	{
+		int status = runBatch(sockFd, batch, quiet, interval, NULL);
+		close(sockFd);
+		return (status);
+	}
+	if (reliable)
+	{
+		t_transfer *rel = calloc(1, sizeof(*rel));
+		if (rel == NULL || (rel->bufs = malloc((size_t)REL_WINDOW * MTU_SIZE)) == NULL)
+		{
+			perror("listener: malloc()");
+			return (EXIT_FAILURE);
+		}
+		rel->loss = loss;
+		rel->rng = nowNs() | 1;
+		int status = runBatch(sockFd, batch, quiet, interval, rel);
+		close(sockFd);
+		return (status);
+	}
+
 	// Main receive loop: print message up to delimiter '\r'
 	char buf[MAXDSIZE];
 	struct sockaddr_storage theirAddr;
@@ -3,15 +3,36 @@
  * @file talker.c
  * @brief UDP client: sends message or stdin to a UDP server in fixed-size chunks.
  *
- * Usage: talker hostname [MSG] [PORT]
+ * Usage: talker [-b | -R [-l LOSS]] [-s SIZE] [-n BATCH] [-r BITRATE | -p PPS] [-d SECONDS] hostname [MSG] [PORT]
+ *   - -b sends full-size datagrams (1472 bytes) in batches of 64 with
+ *     sendmmsg(), unpaced unless -r or -p is given.
+ *   - -s sets the datagram size (default: 10, or 1472 with -b).
+ *   - -n sets the datagrams per sendmmsg() call (default: 1, or 64 with -b).
+ *   - -r paces the payload to BITRATE bits per second (k, M and G
+ *     suffixes), -p to PPS datagrams per second (default: 1000 without -b).
+ *   - -d sends filler datagrams for SECONDS instead of a message, as a
+ *     load generator.
+ *   - -R transfers reliably and in order to a `listener -R`: datagrams are
+ *     numbered, acknowledged and retransmitted, under congestion control.
+ *     Defaults are those of -b.
+ *   - -l drops a LOSS fraction (0 to 1) of the datagrams sent with -R, to
+ *     simulate a lossy link.
  *   - If MSG is omitted, reads from stdin.
  *   - If PORT is omitted, uses default 4242.
  */
 
+#define _GNU_SOURCE // sendmmsg()
+
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <iso646.h>
@@ -19,7 +40,106 @@
 #define DEFAULT_PORT "4242"
 #define DEFAULT_MSG "Hello from talker!"
 #define MAXDSIZE 10
+#define BULK_SIZE 1472	  // Fills a 1500-byte MTU after the IPv4 and UDP headers
+#define MAX_DATAGRAM 65507 // Largest UDP payload over IPv4
+#define DEFAULT_BATCH 64
+#define MAX_BATCH 1024
+#define DEFAULT_PPS 1000 // Without -b, as the fixed 1 ms sleep used to
+#define PACER_SLACK_MS 10 // Sending time the token bucket can hold at least
+#define USAGE "Usage: talker [-b | -R [-l LOSS]] [-s SIZE] [-n BATCH] [-r BITRATE | -p PPS] [-d SECONDS] hostname [MSG] [PORT]\n"
+
+// Reliable mode (-R), must match listener.c
+#define REL_HEADER_SIZE 16 // type, flags, 2 unused, session, sequence, timestamp (us)
+#define REL_MAX_SIZE 1500  // Listener receive buffer (MTU_SIZE), larger datagrams are truncated
+#define REL_ACK_SIZE 20	   // type, SACK blocks, 2 unused, session, cumulative ack, echoed timestamp, window
+#define REL_DATA 1
+#define REL_ACK 2
+#define REL_FIN 0x01	  // Data flag: end of the transfer, carries no payload
+#define REL_MAX_SACKS 4	  // [start, end) pairs after the ack header
+#define REL_WINDOW 4096	  // Datagrams kept until acknowledged, and the listener's reorder window
+#define REL_INITIAL_CWND 10
+#define REL_INITIAL_RTO_MS 250
+#define REL_MIN_RTO_MS 5
+#define REL_MAX_RTO_MS 2000
+#define REL_MAX_BACKOFFS 10 // Timeouts in a row before giving up
+#define REL_MIN_PTO_US 200	// Floor of the tail loss probe timeout
+
+/**
+ * @brief Token bucket pacing the datagrams.
+ */
+typedef struct s_pacer
+{
+	double rate;   // Tokens per second, 0 when unpaced
+	double burst;  // Bucket size
+	double tokens;
+	uint64_t last; // nowNs() of the last refill
+} t_pacer;
+
+/**
+ * @brief Where the datagrams come from.
+ */
+typedef struct s_source
+{
+	const char *msg; // Message argument, or NULL for stdin
+	size_t len;
+	size_t offset;
+	uint64_t deadline; // With -d: filler until then, instead of msg or stdin
+} t_source;
 
+/**
+ * @brief Where a datagram of the reliable window stands.
+ */
+typedef enum e_seg_state
+{
+	SEG_QUEUED,	  // Filled, waiting for its (re)transmission
+	SEG_INFLIGHT, // Sent, neither acknowledged nor lost
+	SEG_SACKED,	  // Acknowledged
+	SEG_LOST	  // Declared lost, to retransmit
+} t_seg_state;
+
+/**
+ * @brief One datagram of the reliable window.
+ */
+typedef struct s_segment
+{
+	uint64_t sent; // nowNs() of the last transmission
+	uint32_t len;  // Header included
+	uint8_t state; // t_seg_state
+} t_segment;
+
+/**
+ * @brief Sender state of a reliable transfer (-R).
+ */
+typedef struct s_reliable
+{
+	int sockFd;
+	int size;	 // Datagram size, header included
+	char *bufs;	 // REL_WINDOW datagrams, indexed by sequence % REL_WINDOW
+	t_segment segs[REL_WINDOW];
+	uint32_t session; // Tells the listener this transfer from earlier ones
+	uint32_t una;	  // Oldest datagram not acknowledged
+	uint32_t nxt;	  // Next datagram to send for the first time
+	uint32_t end;	  // Next datagram to fill from the source
+	bool finQueued;
+	uint32_t inflight; // Datagrams in SEG_INFLIGHT
+	uint32_t lost;	   // Datagrams in SEG_LOST
+	uint32_t peerWindow;
+	double cwnd; // Congestion window, datagrams
+	double ssthresh;
+	bool recovering; // Window already cut for the losses before `recover`
+	uint32_t recover;
+	uint64_t rackSent; // Latest transmission time of a delivered datagram
+	uint64_t srtt;	   // Smoothed RTT, ns
+	uint64_t rttvar;
+	uint64_t rto;
+	uint64_t rtoDeadline;	// 0 while nothing is in flight
+	uint64_t probeDeadline; // Tail loss probe, 0 when not armed
+	bool probed;			// Probe sent, no delivery since
+	int backoffs;
+	double loss; // Drop injector (-l)
+	uint64_t rng;
+	unsigned long long bytes, sent, retransmitted, dropped, timeouts, probes, acks;
+} t_reliable;
 
 /**
  * @brief Extracts pointer to IPv4 or IPv6 address from sockaddr.
@@ -32,43 +152,635 @@ void *getinaddr(struct sockaddr *sa)
 }
 
 /**
- * @brief Main entry point. Sends a message or stdin to a UDP server in MAXDSIZE chunks.
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/**
+ * @brief Parse a bitrate such as "800k", "1.5M" or "10G" (bits per second).
+ * @return the rate, or -1 if malformed
+ */
+double parseRate(const char *arg)
+{
+	char *end;
+	double rate = strtod(arg, &end);
+
+	if (end == arg || rate <= 0)
+		return (-1);
+	if (*end == 'k' || *end == 'K')
+		rate *= 1e3, end++;
+	else if (*end == 'm' || *end == 'M')
+		rate *= 1e6, end++;
+	else if (*end == 'g' || *end == 'G')
+		rate *= 1e9, end++;
+	return (*end == '\0' ? rate : -1);
+}
+
+/**
+ * @brief Grant up to `wanted` datagrams of `cost` tokens each.
+ *
+ * Tokens accrue at the pacer rate, up to the bucket size; when not even one
+ * datagram is covered, sleeps until it is (absolute deadline, so the
+ * rate does not drift with oversleeping). Unpaced (rate 0) grants
+ * everything.
+ *
+ * @return the number of datagrams that may be sent now, at least 1
  */
-int main(int argc, char const *argv[])
+int pacerGrant(t_pacer *pacer, double cost, int wanted)
 {
-	struct addrinfo hints, *theirAddr;
-	const char *hostname, *port, *msg;
+	if (pacer->rate <= 0)
+		return (wanted);
 
-	// Parse arguments: hostname required, MSG and PORT optional
-	if (argc < 2 or argc > 4)
+	uint64_t now = nowNs();
+	pacer->tokens += (now - pacer->last) * pacer->rate / 1e9;
+	pacer->last = now;
+	if (pacer->tokens > pacer->burst)
+		pacer->tokens = pacer->burst;
+	if (pacer->tokens < cost)
 	{
-		fprintf(stderr, "Usage: talker hostname [MSG] [PORT]\n");
-		return (EXIT_FAILURE);
+		uint64_t wake = now + (uint64_t)((cost - pacer->tokens) * 1e9 / pacer->rate);
+		struct timespec ts = {.tv_sec = wake / 1000000000ULL, .tv_nsec = wake % 1000000000ULL};
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		pacer->tokens = cost;
+		pacer->last = wake;
 	}
-	hostname = argv[1];
-	if (argc > 2)
+	int granted = (int)(pacer->tokens / cost);
+	if (granted > wanted)
+		granted = wanted;
+	pacer->tokens -= granted * cost;
+	return (granted);
+}
+
+/**
+ * @brief Send `count` prepared datagrams, retrying the ones sendmmsg() left.
+ * @return 0 on success, -1 on failure
+ */
+int sendBatch(int sockFd, struct mmsghdr *msgs, int count)
+{
+	int sent = 0;
+
+	while (sent < count)
 	{
-		msg = argv[2];
-		if (argc == 4)
-			port = argv[3];
+		int rc = sendmmsg(sockFd, msgs + sent, count - sent, 0);
+		if (rc == -1 && errno == EINTR)
+			continue;
+		if (rc == -1)
+			return (-1);
+		sent += rc;
+	}
+	return (0);
+}
+
+/**
+ * @brief Fill the next datagrams of a batch from the data source.
+ *
+ * The source is, in order of precedence, `seconds` of filler datagrams
+ * (until `deadline`), the message argument, or stdin; a short read from
+ * stdin ends the batch early, so interactive input is not held back.
+ *
+ * @return the number of datagrams filled, 0 at the end of the data, -1 on error
+ */
+int fillBatch(t_source *src, char *bufs, struct iovec *iovs, int batch, int size)
+{
+	int count = 0;
+
+	for (; count < batch; count++)
+	{
+		char *buf = bufs + (size_t)count * size;
+		ssize_t len;
+		if (src->deadline != 0)
+		{
+			if (count == 0 && nowNs() >= src->deadline)
+				break;
+			len = size; // Filler already in place
+		}
+		else if (src->msg != NULL)
+		{
+			len = src->len - src->offset < (size_t)size ? src->len - src->offset : (size_t)size;
+			memcpy(buf, src->msg + src->offset, len);
+			src->offset += len;
+		}
 		else
-			port = DEFAULT_PORT;
+		{
+			while ((len = read(STDIN_FILENO, buf, size)) == -1 && errno == EINTR)
+				;
+			if (len == -1)
+				return (-1);
+		}
+		if (len == 0)
+			break;
+		iovs[count].iov_len = len;
+		if (src->deadline == 0 && src->msg == NULL && len < size)
+			return (count + 1);
+	}
+	return (count);
+}
+
+/**
+ * @brief Whether sequence number `a` comes before `b`, across wrap-around.
+ */
+bool seqBefore(uint32_t a, uint32_t b)
+{
+	return ((int32_t)(a - b) < 0);
+}
+
+/**
+ * @brief Store a 32-bit value in network byte order.
+ */
+void putU32(char *p, uint32_t value)
+{
+	value = htonl(value);
+	memcpy(p, &value, sizeof(value));
+}
+
+/**
+ * @brief Read a 32-bit value in network byte order.
+ */
+uint32_t getU32(const char *p)
+{
+	uint32_t value;
+
+	memcpy(&value, p, sizeof(value));
+	return (ntohl(value));
+}
+
+/**
+ * @brief Drop injector: true for a `loss` fraction of the calls (xorshift64*).
+ */
+bool injectDrop(double loss, uint64_t *rng)
+{
+	if (loss <= 0)
+		return (false);
+	*rng ^= *rng >> 12;
+	*rng ^= *rng << 25;
+	*rng ^= *rng >> 27;
+	return ((*rng * 0x2545F4914F6CDD1DULL >> 11) * (1.0 / 9007199254740992.0) < loss);
+}
+
+/**
+ * @brief Datagram buffer of a sequence number.
+ */
+char *relSlot(t_reliable *rel, uint32_t seq)
+{
+	return (rel->bufs + (size_t)(seq % REL_WINDOW) * rel->size);
+}
+
+/**
+ * @brief Count a datagram as delivered, by the cumulative ack or a SACK block.
+ * @return 1 if it was not known to be delivered yet, 0 otherwise
+ */
+int relDelivered(t_reliable *rel, uint32_t seq)
+{
+	t_segment *seg = &rel->segs[seq % REL_WINDOW];
+
+	if (seg->state == SEG_SACKED)
+		return (0);
+	if (seg->state == SEG_INFLIGHT)
+		rel->inflight--;
+	else if (seg->state == SEG_LOST)
+		rel->lost--;
+	seg->state = SEG_SACKED;
+	if (seg->sent > rel->rackSent)
+		rel->rackSent = seg->sent;
+	return (1);
+}
+
+/**
+ * @brief Fold an RTT sample into the smoothed RTT and the RTO (RFC 6298).
+ */
+void relUpdateRtt(t_reliable *rel, uint64_t rtt)
+{
+	if (rel->srtt == 0)
+	{
+		rel->srtt = rtt;
+		rel->rttvar = rtt / 2;
 	}
 	else
 	{
-		msg = NULL;
-		port = DEFAULT_PORT;
+		uint64_t delta = rtt > rel->srtt ? rtt - rel->srtt : rel->srtt - rtt;
+		rel->rttvar = (3 * rel->rttvar + delta) / 4;
+		rel->srtt = (7 * rel->srtt + rtt) / 8;
+	}
+	rel->rto = rel->srtt + 4 * rel->rttvar;
+	if (rel->rto < REL_MIN_RTO_MS * 1000000ULL)
+		rel->rto = REL_MIN_RTO_MS * 1000000ULL;
+	if (rel->rto > REL_MAX_RTO_MS * 1000000ULL)
+		rel->rto = REL_MAX_RTO_MS * 1000000ULL;
+}
+
+/**
+ * @brief Tail loss probe timeout: two smoothed RTTs, well before the RTO.
+ */
+uint64_t relProbeTimeout(const t_reliable *rel)
+{
+	uint64_t pto = rel->srtt ? 2 * rel->srtt : rel->rto;
+
+	return (pto > REL_MIN_PTO_US * 1000ULL ? pto : REL_MIN_PTO_US * 1000ULL);
+}
+
+/**
+ * @brief Handle one acknowledgement from the listener.
+ *
+ * Datagrams below the cumulative ack and inside the SACK blocks are
+ * delivered. A datagram still in flight that was sent more than a quarter
+ * of the smoothed RTT before one that got through is lost (as in RACK):
+ * it is queued for retransmission, and the first loss of a window halves
+ * the congestion window. Otherwise the window grows by one datagram per
+ * delivered datagram in slow start, by one per window afterwards.
+ */
+void relHandleAck(t_reliable *rel, const char *buf, ssize_t len, uint64_t now)
+{
+	if (len < REL_ACK_SIZE || buf[0] != REL_ACK || getU32(buf + 4) != rel->session)
+		return;
+	int blocks = (uint8_t)buf[1];
+	if (blocks > REL_MAX_SACKS || len < REL_ACK_SIZE + blocks * 8)
+		return;
+	uint32_t cum = getU32(buf + 8);
+	if (seqBefore(rel->nxt, cum))
+		return;
+	rel->acks++;
+
+	// The echoed timestamp belongs to the datagram that triggered the ack,
+	// so retransmissions give valid samples too
+	uint32_t echo = getU32(buf + 12);
+	relUpdateRtt(rel, (uint64_t)(uint32_t)(now / 1000 - echo) * 1000);
+	rel->peerWindow = getU32(buf + 16);
+
+	int delivered = 0;
+	for (; seqBefore(rel->una, cum); rel->una++)
+		delivered += relDelivered(rel, rel->una);
+	for (int i = 0; i < blocks; i++)
+	{
+		uint32_t start = getU32(buf + REL_ACK_SIZE + i * 8);
+		uint32_t end = getU32(buf + REL_ACK_SIZE + i * 8 + 4);
+		if (seqBefore(start, rel->una))
+			start = rel->una;
+		if (seqBefore(rel->nxt, end))
+			end = rel->nxt;
+		for (uint32_t seq = start; seqBefore(seq, end); seq++)
+			delivered += relDelivered(rel, seq);
+	}
+	if (delivered == 0)
+		return;
+
+	if (rel->recovering && !seqBefore(rel->una, rel->recover))
+		rel->recovering = false;
+	bool lost = false;
+	for (uint32_t seq = rel->una; seqBefore(seq, rel->nxt); seq++)
+	{
+		t_segment *seg = &rel->segs[seq % REL_WINDOW];
+		if (seg->state == SEG_INFLIGHT && seg->sent + rel->srtt / 4 < rel->rackSent)
+		{
+			seg->state = SEG_LOST;
+			rel->inflight--;
+			rel->lost++;
+			lost = true;
+		}
+	}
+	if (lost && !rel->recovering)
+	{
+		rel->ssthresh = rel->cwnd / 2 > 2 ? rel->cwnd / 2 : 2;
+		rel->cwnd = rel->ssthresh;
+		rel->recovering = true;
+		rel->recover = rel->nxt;
+	}
+	else if (!rel->recovering)
+	{
+		rel->cwnd += rel->cwnd < rel->ssthresh ? delivered : delivered / rel->cwnd;
+		if (rel->cwnd > REL_WINDOW)
+			rel->cwnd = REL_WINDOW;
+	}
+	rel->backoffs = 0;
+	rel->rtoDeadline = (rel->una == rel->nxt) ? 0 : now + rel->rto;
+	rel->probed = false;
+	rel->probeDeadline = (rel->una == rel->nxt) ? 0 : now + relProbeTimeout(rel);
+}
+
+/**
+ * @brief Retransmission timeout: everything in flight is lost, the window
+ * restarts from one datagram and the timeout doubles.
+ * @return 0, or -1 after REL_MAX_BACKOFFS timeouts in a row
+ */
+int relTimeout(t_reliable *rel, uint64_t now)
+{
+	for (uint32_t seq = rel->una; seqBefore(seq, rel->nxt); seq++)
+	{
+		t_segment *seg = &rel->segs[seq % REL_WINDOW];
+		if (seg->state == SEG_INFLIGHT)
+		{
+			seg->state = SEG_LOST;
+			rel->lost++;
+		}
+	}
+	rel->inflight = 0;
+	rel->ssthresh = rel->cwnd / 2 > 2 ? rel->cwnd / 2 : 2;
+	rel->cwnd = 1;
+	rel->recovering = true;
+	rel->recover = rel->nxt;
+	rel->rto = rel->rto * 2 < REL_MAX_RTO_MS * 1000000ULL ? rel->rto * 2 : REL_MAX_RTO_MS * 1000000ULL;
+	rel->rtoDeadline = now + rel->rto;
+	rel->timeouts++;
+	return (++rel->backoffs > REL_MAX_BACKOFFS ? -1 : 0);
+}
+
+/**
+ * @brief Tail loss probe: when acks stop before the RTO, resend the last
+ * datagram not acknowledged yet, once.
+ *
+ * Its ack carries the listener's full SACK state, so losses at the tail
+ * of a flight, or of the acks themselves, are repaired by the usual
+ * loss detection rather than by a timeout that resets the window.
+ */
+void relProbe(t_reliable *rel, uint64_t now)
+{
+	rel->probed = true;
+	for (uint32_t seq = rel->nxt; seqBefore(rel->una, seq); seq--)
+	{
+		t_segment *seg = &rel->segs[(seq - 1) % REL_WINDOW];
+		if (seg->state != SEG_INFLIGHT)
+			continue;
+		char *dgram = relSlot(rel, seq - 1);
+		putU32(dgram + 12, (uint32_t)(now / 1000));
+		seg->sent = now;
+		rel->sent++;
+		rel->retransmitted++;
+		rel->probes++;
+		if (injectDrop(rel->loss, &rel->rng))
+			rel->dropped++;
+		else
+			send(rel->sockFd, dgram, seg->len, 0);
+		rel->rtoDeadline = now + rel->rto;
+		return;
+	}
+}
+
+/**
+ * @brief Whether a datagram may be (re)transmitted now.
+ */
+bool relCanSend(const t_reliable *rel)
+{
+	if (rel->inflight >= (uint32_t)rel->cwnd)
+		return (false);
+	return (rel->lost > 0 || (seqBefore(rel->nxt, rel->end) && rel->nxt - rel->una < rel->peerWindow));
+}
+
+/**
+ * @brief Reliable transfer (-R): numbered datagrams, acknowledged by the
+ * listener with a cumulative ack and SACK blocks.
+ *
+ * Up to REL_WINDOW datagrams are kept until acknowledged. Each turn reads
+ * the next datagrams from the source, sends retransmissions then new
+ * datagrams as far as the congestion and receive windows allow (one
+ * sendmmsg() per batch, through the pacer when -r or -p is set), and waits
+ * for acks until the retransmission timeout. The end of the data is a
+ * datagram with the REL_FIN flag, acknowledged like the others.
+ *
+ * @return 0 once everything was acknowledged, -1 on failure
+ */
+int runReliable(t_reliable *rel, t_source *src, t_pacer *pacer, double cost, int batch)
+{
+	struct mmsghdr *msgs = calloc(batch, sizeof(*msgs));
+	struct iovec *iovs = calloc(batch, sizeof(*iovs));
+	char ack[REL_ACK_SIZE + REL_MAX_SACKS * 8];
+
+	if (msgs == NULL || iovs == NULL)
+	{
+		perror("talker: runReliable: calloc()");
+		return (-1);
+	}
+	while (!rel->finQueued || rel->una != rel->end)
+	{
+		// Read ahead one batch of new datagrams, within the window
+		while (!rel->finQueued && rel->end - rel->una < REL_WINDOW && rel->end - rel->nxt < (uint32_t)batch)
+		{
+			char *dgram = relSlot(rel, rel->end);
+			struct iovec iov;
+			int count = fillBatch(src, dgram + REL_HEADER_SIZE, &iov, 1, rel->size - REL_HEADER_SIZE);
+			if (count == -1)
+			{
+				perror("talker: read()");
+				return (-1);
+			}
+			dgram[0] = REL_DATA;
+			dgram[1] = count == 0 ? REL_FIN : 0;
+			dgram[2] = dgram[3] = 0;
+			putU32(dgram + 4, rel->session);
+			putU32(dgram + 8, rel->end);
+			rel->segs[rel->end % REL_WINDOW] = (t_segment){.len = REL_HEADER_SIZE + (count ? iov.iov_len : 0), .state = SEG_QUEUED};
+			rel->bytes += count ? iov.iov_len : 0;
+			rel->finQueued = count == 0;
+			rel->end++;
+		}
+
+		// Retransmissions first, oldest first, then new datagrams, as far as
+		// the congestion window and the pacer allow
+		uint64_t now = nowNs();
+		int allowed = relCanSend(rel) ? pacerGrant(pacer, cost, batch) : 0, count = 0;
+		if (allowed > (int)rel->cwnd - (int)rel->inflight)
+		{
+			pacer->tokens += (allowed - ((int)rel->cwnd - (int)rel->inflight)) * cost; // Unused grant
+			allowed = (int)rel->cwnd - (int)rel->inflight;
+		}
+		for (uint32_t seq = rel->una; rel->lost > 0 && count < allowed && seqBefore(seq, rel->nxt); seq++)
+		{
+			t_segment *seg = &rel->segs[seq % REL_WINDOW];
+			if (seg->state != SEG_LOST)
+				continue;
+			rel->lost--;
+			rel->retransmitted++;
+			seg->state = SEG_QUEUED;
+			iovs[count++] = (struct iovec){.iov_base = relSlot(rel, seq), .iov_len = seg->len};
+		}
+		while (count < allowed && rel->lost == 0 && seqBefore(rel->nxt, rel->end) && rel->nxt - rel->una < rel->peerWindow)
+			iovs[count++] = (struct iovec){.iov_base = relSlot(rel, rel->nxt), .iov_len = rel->segs[rel->nxt++ % REL_WINDOW].len};
+		if (count < allowed)
+			pacer->tokens += (allowed - count) * cost;
+
+		// Stamp and send, leaving out what the drop injector takes
+		int kept = 0;
+		for (int i = 0; i < count; i++)
+		{
+			char *dgram = iovs[i].iov_base;
+			t_segment *seg = &rel->segs[getU32(dgram + 8) % REL_WINDOW];
+			putU32(dgram + 12, (uint32_t)(now / 1000));
+			seg->state = SEG_INFLIGHT;
+			seg->sent = now;
+			rel->inflight++;
+			rel->sent++;
+			if (injectDrop(rel->loss, &rel->rng))
+			{
+				rel->dropped++;
+				continue;
+			}
+			msgs[kept].msg_hdr.msg_iov = &iovs[i];
+			msgs[kept++].msg_hdr.msg_iovlen = 1;
+		}
+		// A refused send (no listener yet) is a loss like any other
+		if (kept > 0 && sendBatch(rel->sockFd, msgs, kept) == -1 && errno != ECONNREFUSED)
+		{
+			perror("talker: sendmmsg()");
+			return (-1);
+		}
+		if (count > 0 && rel->rtoDeadline == 0)
+			rel->rtoDeadline = now + rel->rto;
+		if (count > 0 && !rel->probed)
+			rel->probeDeadline = now + relProbeTimeout(rel);
+
+		// Wait for acks until the probe or the RTO is due, unless more can
+		// go out right away (ppoll() for timeouts below a millisecond)
+		uint64_t deadline = rel->rtoDeadline, wait = 0;
+		if (rel->probeDeadline != 0 && !rel->probed && rel->probeDeadline < deadline)
+			deadline = rel->probeDeadline;
+		if (!relCanSend(rel) && deadline == 0)
+			wait = REL_MIN_RTO_MS * 1000000ULL; // Receive window closed, nothing in flight
+		else if (!relCanSend(rel))
+			wait = deadline > now ? deadline - now : 0;
+		struct timespec ts = {.tv_sec = wait / 1000000000ULL, .tv_nsec = wait % 1000000000ULL};
+		struct pollfd pfd = {.fd = rel->sockFd, .events = POLLIN};
+		if (ppoll(&pfd, 1, &ts, NULL) == -1 && errno != EINTR)
+		{
+			perror("talker: ppoll()");
+			return (-1);
+		}
+		ssize_t len;
+		while ((len = recv(rel->sockFd, ack, sizeof(ack), MSG_DONTWAIT)) != -1 || errno == ECONNREFUSED)
+			if (len > 0)
+				relHandleAck(rel, ack, len, nowNs());
+
+		now = nowNs();
+		if (rel->probeDeadline != 0 && !rel->probed && now >= rel->probeDeadline &&
+			(rel->rtoDeadline == 0 || now < rel->rtoDeadline))
+			relProbe(rel, now);
+		if (rel->rtoDeadline != 0 && now >= rel->rtoDeadline && relTimeout(rel, now) == -1)
+		{
+			fprintf(stderr, "talker: no acknowledgement from the listener, giving up\n");
+			return (-1);
+		}
+	}
+	free(msgs);
+	free(iovs);
+	return (0);
+}
+
+/**
+ * @brief Set up and run a reliable transfer, then print what it took.
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int sendReliable(int sockFd, t_source *src, t_pacer *pacer, double cost, int size, int batch,
+				 double loss, int seconds)
+{
+	t_reliable *rel = calloc(1, sizeof(*rel));
+	char *bufs = malloc((size_t)REL_WINDOW * size);
+
+	if (rel == NULL || bufs == NULL)
+	{
+		perror("talker: sendReliable: malloc()");
+		return (EXIT_FAILURE);
+	}
+	memset(bufs, 'x', (size_t)REL_WINDOW * size); // Filler for -d
+	uint64_t start = nowNs();
+	rel->sockFd = sockFd;
+	rel->size = size;
+	rel->bufs = bufs;
+	rel->session = (uint32_t)(start ^ (start >> 32) ^ ((uint64_t)getpid() << 16));
+	rel->peerWindow = REL_WINDOW;
+	rel->cwnd = REL_INITIAL_CWND;
+	rel->ssthresh = REL_WINDOW;
+	rel->rto = REL_INITIAL_RTO_MS * 1000000ULL;
+	rel->loss = loss;
+	rel->rng = start | 1;
+	if (seconds > 0)
+		src->deadline = start + seconds * 1000000000ULL;
+
+	int status = runReliable(rel, src, pacer, cost, batch) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	double elapsed = (nowNs() - start) / 1e9;
+	printf("talker: %llu bytes in %.2f s: %.2f Mbit/s, %llu datagrams, %llu retransmitted, "
+		   "%llu dropped, %llu probes, %llu timeouts, srtt %.0f us, cwnd %.0f\n",
+		   rel->bytes, elapsed, elapsed > 0 ? rel->bytes * 8 / elapsed / 1e6 : 0.0, rel->sent,
+		   rel->retransmitted, rel->dropped, rel->probes, rel->timeouts, rel->srtt / 1e3, rel->cwnd);
+	free(bufs);
+	free(rel);
+	return (status);
+}
+
+/**
+ * @brief Main entry point. Sends a message, stdin or filler to a UDP server
+ * in paced batches of datagrams.
+ */
+int main(int argc, char *const argv[])
+{
+	t_source src = {0};
+	t_pacer pacer = {0};
+	const char *hostname, *port;
+	int size = 0, batch = 0, seconds = 0, opt;
+	double bitrate = 0, pps = 0, loss = 0;
+	bool bulk = false, reliable = false;
+
+	// Parse arguments: options, then hostname required, MSG and PORT optional
+	while ((opt = getopt(argc, argv, "bRl:s:n:r:p:d:")) != -1)
+	{
+		if (opt == 'b')
+			bulk = true;
+		else if (opt == 'R')
+			reliable = true;
+		else if (opt == 'l' && (loss = atof(optarg)) >= 0 && loss < 1)
+			continue;
+		else if (opt == 's' && (size = atoi(optarg)) >= 1 && size <= MAX_DATAGRAM)
+			continue;
+		else if (opt == 'n' && (batch = atoi(optarg)) >= 1 && batch <= MAX_BATCH)
+			continue;
+		else if (opt == 'r' && pps == 0 && (bitrate = parseRate(optarg)) > 0)
+			continue;
+		else if (opt == 'p' && bitrate == 0 && (pps = atof(optarg)) > 0)
+			continue;
+		else if (opt == 'd' && (seconds = atoi(optarg)) >= 1)
+			continue;
+		else
+		{
+			fprintf(stderr, USAGE);
+			return (EXIT_FAILURE);
+		}
+	}
+	if (argc - optind < 1 or argc - optind > 3 or (bulk and reliable) or (loss > 0 and !reliable))
+	{
+		fprintf(stderr, USAGE);
+		return (EXIT_FAILURE);
+	}
+	hostname = argv[optind];
+	if (argc - optind > 1)
+	{
+		src.msg = argv[optind + 1];
+		src.len = strlen(src.msg);
+	}
+	port = (argc - optind > 2) ? argv[optind + 2] : DEFAULT_PORT;
+
+	// -b and -R switch the defaults to full-size, batched, unpaced datagrams
+	if (size == 0)
+		size = (bulk || reliable) ? BULK_SIZE : MAXDSIZE;
+	if (batch == 0)
+		batch = (bulk || reliable) ? DEFAULT_BATCH : 1;
+	if (bitrate == 0 && pps == 0 && !bulk && !reliable)
+		pps = DEFAULT_PPS;
+	if (reliable && (size <= REL_HEADER_SIZE || size > REL_MAX_SIZE))
+	{
+		fprintf(stderr, "talker: -R needs datagrams of %d to %d bytes\n", REL_HEADER_SIZE + 1, REL_MAX_SIZE);
+		return (EXIT_FAILURE);
 	}
 
 	setbuf(stdout, NULL); // Disable buffering for stdout
 	setbuf(stderr, NULL); // Disable buffering for stderr
 
-	// Setup UDP socket hints
-	hints = (struct addrinfo){0};
+	// Resolve server address (IPv4, like the listener)
+	struct addrinfo hints = {0}, *theirAddr, *p;
 	hints.ai_family = AF_INET;
 	hints.ai_socktype = SOCK_DGRAM;
-
-	// Resolve server address
 	int rv;
 	if ((rv = getaddrinfo(hostname, port, &hints, &theirAddr)) != 0)
 	{
@@ -76,81 +788,123 @@ int main(int argc, char const *argv[])
 		return (EXIT_FAILURE);
 	}
 
-	// Create UDP socket
-	struct addrinfo *p;
-	int sockFd;
+	// Connect the UDP socket to the first routable address, so that plain
+	// send() is used and the route is looked up once
+	int sockFd = -1;
 	for (p = theirAddr; p != NULL; p = p->ai_next)
 	{
-		// Create socket
 		if ((sockFd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
 		{
 			perror("talker: socket()");
 			continue;
 		}
-
+		if (connect(sockFd, p->ai_addr, p->ai_addrlen) == -1)
+		{
+			perror("talker: connect()");
+			close(sockFd);
+			continue;
+		}
 		break;
 	}
-
-	// Check if we successfully created a socket
+	freeaddrinfo(theirAddr);
 	if (p == NULL)
 	{
-		fprintf(stderr, "talker: couldn't connect!");
+		fprintf(stderr, "talker: couldn't connect!\n");
 		return (EXIT_FAILURE);
 	}
 
-	int rc;
-	if (msg) // If a message is provided
+	// Packet rate, or payload bitrate, with a bucket of one batch or of
+	// PACER_SLACK_MS, so that time lost oversleeping is made up for
+	double cost = 1;
+	pacer.rate = pps;
+	if (bitrate > 0)
 	{
-		// Send provided message argument in MAXDSIZE chunks
-		size_t sent = 0, msglen = strlen(msg), remain, chunk;
-		while (sent < msglen)
-		{
-			remain = msglen - sent;
-			chunk = (remain > MAXDSIZE) ? MAXDSIZE : remain; // Limit chunk size to MAXDSIZE
-			if ((rc = sendto(sockFd, msg + sent, chunk, 0,
-							 p->ai_addr, p->ai_addrlen)) == -1)
-			{
-				perror("talker: sendto()");
-				close(sockFd);
-				freeaddrinfo(theirAddr);
-				return (EXIT_FAILURE);
-			}
-			sent += chunk; // Update total bytes sent
-			usleep(1000); // avoid flooding
-		}
+		cost = size * 8.0;
+		pacer.rate = bitrate;
 	}
-	else // If no message is provided
+	pacer.burst = cost * batch;
+	if (pacer.burst < pacer.rate * PACER_SLACK_MS / 1000)
+		pacer.burst = pacer.rate * PACER_SLACK_MS / 1000;
+	pacer.tokens = pacer.burst;
+	pacer.last = nowNs();
+
+	if (reliable)
+	{
+		int status = sendReliable(sockFd, &src, &pacer, cost, size, batch, loss, seconds);
+		if (status == EXIT_SUCCESS)
+			printf("talker: message was sent to %s!\n", hostname);
+		close(sockFd);
+		return (status);
+	}
+
+	// Preallocated batch: one buffer and header per datagram
+	char *bufs = malloc((size_t)batch * size);
+	struct mmsghdr *msgs = calloc(batch, sizeof(*msgs));
+	struct iovec *iovs = calloc(batch, sizeof(*iovs));
+	if (bufs == NULL || msgs == NULL || iovs == NULL)
 	{
-		// Read from stdin and send in MAXDSIZE chunks
-		char buf[MAXDSIZE];
-		ssize_t nread;
-		while ((nread = read(STDIN_FILENO, buf, MAXDSIZE)) > 0)
+		perror("talker: malloc()");
+		close(sockFd);
+		return (EXIT_FAILURE);
+	}
+	memset(bufs, 'x', (size_t)batch * size);
+	for (int i = 0; i < batch; i++)
+	{
+		iovs[i].iov_base = bufs + (size_t)i * size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	unsigned long long packets = 0, bytes = 0;
+	uint64_t start = nowNs();
+	if (seconds > 0)
+		src.deadline = start + seconds * 1000000000ULL;
+	while (true)
+	{
+		int count = fillBatch(&src, bufs, iovs, batch, size);
+		if (count == -1)
 		{
-			if ((rc = sendto(sockFd, buf, nread, 0,
-							 p->ai_addr, p->ai_addrlen)) == -1)
+			perror("talker: read()");
+			close(sockFd);
+			return (EXIT_FAILURE);
+		}
+		if (count == 0)
+			break;
+		// The pacer may only let part of the batch go at once
+		for (int done = 0; done < count;)
+		{
+			int granted = pacerGrant(&pacer, cost, count - done);
+			if (sendBatch(sockFd, msgs + done, granted) == -1)
 			{
-				perror("talker: sendto()");
+				perror("talker: sendmmsg()");
 				close(sockFd);
-				freeaddrinfo(theirAddr);
 				return (EXIT_FAILURE);
 			}
-			usleep(1000);
+			for (int i = done; i < done + granted; i++)
+				bytes += iovs[i].iov_len;
+			packets += granted;
+			done += granted;
 		}
 	}
+	double elapsed = (nowNs() - start) / 1e9;
 
 	// Send delimiter to mark end of message (always)
-	if ((rc = sendto(sockFd, "\r", 1, 0,
-					 p->ai_addr, p->ai_addrlen)) == -1)
+	if (send(sockFd, "\r", 1, 0) == -1)
 	{
-		perror("talker: sendto()");
+		perror("talker: send()");
 		close(sockFd);
-		freeaddrinfo(theirAddr);
 		return (EXIT_FAILURE);
 	}
 
 	// Success
 	printf("talker: message was sent to %s!\n", hostname);
-	freeaddrinfo(theirAddr);
+	if (bulk || seconds > 0)
+		printf("talker: %llu datagrams, %llu bytes in %.2f s: %.0f pkt/s, %.2f Mbit/s\n",
+			   packets, bytes, elapsed, elapsed > 0 ? packets / elapsed : 0.0,
+			   elapsed > 0 ? bytes * 8 / elapsed / 1e6 : 0.0);
+	free(bufs);
+	free(msgs);
+	free(iovs);
 	close(sockFd);
 
 	return (EXIT_SUCCESS);